@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "svc.h"
 #include <stdio.h>
 #include <unistd.h>
@@ -6,34 +7,575 @@
 #include <ctype.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ftw.h>
+#include <dirent.h>
+#include <glob.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+#ifdef SVC_USE_ZSTD
+#include <zstd.h>
+#endif
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
-void *svc_init(void) {
-    // Create the helper
-    struct helper *h = malloc(sizeof(struct helper));
+// Structures and helpers used only in this file
+
+// Arguments shared by every job when hashing or storing files in parallel
+struct hash_job_args {
+    struct helper *helper;
+    struct tracked_file *files;
+    size_t *positions;
+    int *results;
+    struct commit *parent; // Changed files are stored as deltas against it
+};
+
+// The start of a delta object, followed by its instructions
+struct delta_header {
+    uint32_t flags;
+    uint32_t mode; // Permissions of the rebuilt file
+    uint64_t base; // Digest of the full object that bytes are copied from
+    uint64_t size; // Length of the rebuilt file
+    uint64_t ops_len; // Length of the instructions once decompressed
+};
+
+// Where a delta is being rebuilt to, with the digest of what was written
+struct delta_writer {
+    int fd;
+    unsigned char *buff;
+    size_t len;
+    uint64_t total;
+    struct digest_state *state;
+    int error;
+};
+
+// Worker threads that run batches of jobs for parallel_for
+struct thread_pool {
+    pthread_t *threads;
+    size_t n_threads;
+    pthread_mutex_t lock;
+    pthread_cond_t work; // Signalled when a batch is posted or on stopping
+    pthread_cond_t done; // Signalled when the last job of a batch finishes
+    void (*fn)(void *, size_t);
+    void *arg;
+    size_t n; // Jobs in the current batch
+    size_t next; // Next job to hand out
+    size_t finished; // Jobs that have finished
+    int stop;
+};
+
+// A whole file to copy as part of a batch given to copy_files
+struct copy_job {
+    char *source;
+    char *dest;
+    struct file_cache *cache; // Set to the copy's signature if not NULL
+    int result; // 0 once copied, -1 if it could not be
+};
+
+// A growable list of paths
+struct file_list {
+    char **names;
+    size_t n;
+    size_t cap;
+};
+
+// Block size used when reading files for hashing
+#define HASH_BLOCK_SIZE (1 << 16)
+// Smaller stored objects are read rather than mapped, as mapping costs more
+#define MAP_MIN_SIZE (1 << 16)
+// Files this large are worth asking for huge pages for
+#define MAP_HUGE_SIZE (1 << 21)
+
+// A whole file's contents, mapped or read into memory
+struct file_map {
+    unsigned char *data;
+    size_t len;
+    int mapped; // Set if data must be unmapped rather than freed
+};
+
+struct digest_state {
+    uint64_t v[4];
+    unsigned char mem[32];
+    size_t mem_size;
+    uint64_t total_len;
+};
+
+// A growable buffer that journal records are built in
+struct byte_buffer {
+    unsigned char *data;
+    size_t len;
+    size_t cap;
+};
+
+// A position in a journal record being read
+struct byte_reader {
+    const unsigned char *p;
+    size_t left;
+    int error; // Set if the record was too short
+};
+
+static void merge_undo(struct helper *h, struct branch *branch,
+                       struct tracked_file *saved, size_t n_current,
+                       struct path **written, size_t n_written);
+
+static int same_contents(int hash_a, uint64_t digest_a, int hash_b,
+                         uint64_t digest_b);
+
+static size_t commit_generation(struct commit *commit);
+
+static struct commit *merge_base(struct helper *helper, struct commit *a,
+                                                        struct commit *b);
+
+static int commit_is_ancestor(struct helper *helper, struct commit *a,
+                                                     struct commit *b);
+
+static void branch_set_head(struct helper *helper, struct branch *branch,
+                            struct commit *commit);
+
+static uint64_t *head_reach(struct commit *commit, size_t *words);
+
+static uint64_t *commit_reach(struct helper *helper, struct commit *commit,
+                                                     size_t *words);
+
+static uint64_t *reach_build(struct helper *helper, struct commit *commit,
+                                                    size_t *words);
+
+static int reach_has(uint64_t *reach, size_t words, struct commit *commit);
+
+static void commit_heap_push(struct commit_heap *heap, struct commit *commit);
+
+static struct commit *commit_heap_pop(struct commit_heap *heap);
+
+static int commit_heap_before(struct commit_heap *heap, struct commit *a,
+                                                       struct commit *b);
+
+static void log_push(struct svc_log *log, struct commit *commit);
+
+static int commit_changes_path(struct helper *helper, struct commit *commit,
+                                                       struct path *path);
+
+static void commit_index_insert(struct helper *helper, struct commit *commit);
+
+static struct branch *find_branch(struct helper *h, char *name);
+
+static void branch_register(struct helper *h, struct branch *branch);
+
+static void branch_index_place(struct helper *h, struct branch *branch);
+
+static size_t sorted_branch_position(struct helper *h, char *name);
+
+static void commit_index_place(struct helper *helper, struct commit *commit);
+
+static void commit_index_rebuild(struct helper *helper);
+
+static size_t string_hash(char *str);
+
+static struct tree_node *find_commit_file(struct helper *helper,
+                                          struct commit *commit,
+                                          struct path *path);
+
+static int path_compare(const struct path *a, const struct path *b);
+
+static long branch_find_file(struct helper *helper, struct branch *branch,
+                                                     char *file_name);
+
+static long branch_find_path(struct branch *branch, struct path *path);
+
+static size_t path_slot(struct path *path);
+
+static void branch_index_add(struct branch *branch, size_t pos);
+
+static void branch_index_rebuild(struct branch *branch);
+
+static int branch_reserve(struct branch *branch, size_t n);
+
+static void hash_job(void *arg, size_t i);
+
+static void commit_hash_job(void *arg, size_t i);
+
+static void store_job(void *arg, size_t i);
+
+static void restore_job(void *arg, size_t i);
+
+static struct thread_pool *pool_create(size_t n_threads);
+
+static void pool_destroy(struct thread_pool *pool);
+
+static void parallel_for(struct helper *helper, size_t n,
+                         void (*fn)(void *, size_t), void *arg);
+
+static int file_list_push(struct file_list *list, char *path);
+
+static void free_file_list(struct file_list *list);
+
+static int add_file_list(struct helper *helper, struct file_list *list);
+
+static int collect_files(struct helper *helper, char *dir_path,
+                         struct stat *repo, struct file_list *list);
+
+static struct helper *helper_new(char *dir);
+
+static void free_helper(struct helper *h);
+
+static char *make_commit(struct helper *h, char *message,
+                         struct commit *merged);
+
+static void branch_set_files(struct helper *helper, struct branch *branch,
+                             struct commit *commit, struct tracked_file *files,
+                             size_t count);
+
+static struct tracked_file *commit_tracked_files(struct helper *helper,
+                                                 struct commit *commit,
+                                                 size_t *count);
+
+static void commit_read_files(struct helper *h, struct commit *commit);
+
+static struct commit *commit_base(struct commit *commit);
+
+static struct tree_node *commit_tree(struct helper *h, struct commit *commit);
+
+static int snapshot_commit(struct helper *helper, struct commit *commit);
+
+static int store_blob(struct helper *helper, struct tracked_file *file,
+                                              uint64_t base);
+
+static char *blob_path(struct helper *helper, uint64_t digest);
+
+static int restore_file(struct helper *helper, struct tracked_file *file,
+                                               struct file_cache *cache);
+
+static int copy_file(char *source, char *dest);
+
+static int copy_fd(int in, int out, off_t size);
+
+static int copy_files(struct helper *helper, struct copy_job *jobs, size_t n);
+
+static void copy_job_run(void *arg, size_t i);
+
+static int restore_files(struct helper *helper, struct tracked_file *files,
+                         size_t *positions, size_t n, int *results);
+
+static char *temp_path(char *dest);
+
+static int make_parent_dirs(char *path);
+
+static int remove_tree(char *path);
+
+static int hash_file_digest(void *helper, char *file_path, uint64_t *digest,
+                                                           struct stat *st);
+
+static void hash_tracked_file(struct helper *helper, struct tracked_file *file);
+
+static void cache_from_stat(struct file_cache *cache, struct stat *st);
+
+static int cache_matches(struct file_cache *cache, struct stat *st);
+
+static int file_unchanged(struct helper *helper, struct tracked_file *file,
+                                                 struct stat *st);
+
+static uint64_t sum_bytes(const unsigned char *buff, size_t len);
+
+static void digest_init(struct digest_state *state);
+
+static void digest_update(struct digest_state *state, const unsigned char *buff,
+                                                                    size_t len);
+
+static uint64_t digest_final(struct digest_state *state);
+
+static int journal_create(struct helper *helper);
+
+static size_t journal_replay(struct helper *h, unsigned char *map, size_t size,
+                                                                  size_t start);
+
+static unsigned char *checkpoint_map(char *dir, size_t *len);
+
+static size_t checkpoint_load(struct helper *h, unsigned char *map,
+                              size_t size, size_t journal_size);
+
+static int checkpoint_due(struct helper *h);
+
+static int checkpoint_write(struct helper *h);
+
+static int journal_append(struct helper *helper, char type,
+                                                struct byte_buffer *payload);
+
+static int journal_write_commit(struct helper *helper, struct commit *commit);
+
+static int journal_write_branch(struct helper *helper, struct branch *branch);
+
+static int journal_write_head(struct helper *helper, struct branch *branch,
+                                                     struct commit *commit);
+
+static int journal_write_current(struct helper *helper, struct branch *branch);
+
+static int journal_write_stage(struct helper *helper, struct branch *branch);
+
+static struct commit *journal_read_commit(struct helper *h,
+                                          struct byte_reader *r);
+
+static int journal_read_branch(struct helper *h, struct byte_reader *r);
+
+static int journal_read_stage(struct helper *h, struct branch *branch,
+                                               struct byte_reader *r);
+
+static void buffer_put_file(struct byte_buffer *b, struct tracked_file *file,
+                                                               int with_cache);
+
+static void reader_file(struct helper *h, struct byte_reader *r,
+                        struct tracked_file *file, int with_cache);
+
+static void reader_skip_files(struct byte_reader *r, uint32_t n);
+
+static void buffer_put(struct byte_buffer *b, const void *data, size_t len);
+
+static void buffer_put_u32(struct byte_buffer *b, uint32_t v);
+
+static void buffer_put_u64(struct byte_buffer *b, uint64_t v);
+
+static void buffer_put_str(struct byte_buffer *b, char *str);
+
+static void buffer_put_varint(struct byte_buffer *b, uint64_t v);
+
+static void reader_bytes(struct byte_reader *r, void *out, size_t len);
+
+static uint32_t reader_u32(struct byte_reader *r);
+
+static uint64_t reader_u64(struct byte_reader *r);
+
+static uint64_t reader_varint(struct byte_reader *r);
+
+static char *reader_str(struct byte_reader *r);
+
+static const char *reader_span(struct byte_reader *r, uint32_t *len);
+
+static int write_all(int fd, const void *data, size_t len);
+
+static void *arena_alloc(struct arena *arena, size_t size);
+
+static char *arena_strdup(struct arena *arena, const char *str, size_t len);
+
+static void arena_free(struct arena *arena);
+
+static size_t string_hash_len(const char *str, size_t len);
+
+static struct path *find_path(struct helper *helper, const char *name);
+
+static struct path *lookup_path(struct helper *helper, const char *name,
+                                size_t len, size_t *slot);
+
+static struct path *intern_path(struct helper *helper, const char *name,
+                                size_t len);
+
+static struct tree_node *tree_apply(struct helper *h, struct tree_node *root,
+                                                      struct commit *commit);
+
+static struct tree_node *tree_from_listing(struct helper *h, size_t pos);
+
+static struct tree_node *tree_own(struct helper *h, uint32_t gen,
+                                                   struct tree_node *node);
+
+static size_t tree_size(struct tree_node *node);
+
+static void tree_update(struct tree_node *node);
+
+static uint64_t tree_priority(struct path *path);
 
+static int tree_compare(struct path *a, struct path *b);
+
+static struct tree_node *tree_insert(struct helper *h, uint32_t gen,
+                                     struct tree_node *node,
+                                     struct tracked_file *file);
+
+static void tree_split(struct helper *h, uint32_t gen, struct tree_node *node,
+                       struct path *path, struct tree_node **left,
+                       struct tree_node **right);
+
+static struct tree_node *tree_remove(struct helper *h, uint32_t gen,
+                                     struct tree_node *node, struct path *path);
+
+static struct tree_node *tree_join(struct helper *h, uint32_t gen,
+                                   struct tree_node *left,
+                                   struct tree_node *right);
+
+static struct tree_node *tree_find(struct tree_node *node, struct path *path);
+
+static void tree_to_files(struct tree_node *node, struct tracked_file *files,
+                                                  size_t *index);
+
+static char *delta_path(struct helper *helper, uint64_t digest);
+
+static int object_exists(struct helper *helper, uint64_t digest);
+
+static uint64_t object_base(struct helper *helper, uint64_t digest);
+
+static int store_delta(struct helper *helper, struct tracked_file *file,
+                                              uint64_t base);
+
+static int delta_encode(const unsigned char *base, size_t base_len,
+                        const unsigned char *data, size_t len,
+                        struct byte_buffer *out, size_t limit);
+
+static uint64_t delta_block_hash(const unsigned char *data);
+
+static void delta_put_insert(struct byte_buffer *out, const unsigned char *data,
+                                                      size_t len);
+
+static void delta_put_copy(struct byte_buffer *out, size_t offset, size_t len);
+
+static int write_delta(struct helper *helper, uint64_t digest,
+                       struct delta_header *header, struct byte_buffer *ops);
+
+static unsigned char *read_delta(struct helper *helper, uint64_t digest,
+                                           struct delta_header *header);
+
+static int restore_delta(struct helper *helper, uint64_t digest, char *dest);
+
+static int apply_delta(struct delta_writer *w, const unsigned char *base,
+                       size_t base_len, const unsigned char *ops,
+                       size_t ops_len);
+
+static void delta_write(struct delta_writer *w, const unsigned char *data,
+                                                size_t len);
+
+static void delta_flush(struct delta_writer *w);
+
+static int map_file(char *path, struct file_map *map, struct stat *st,
+                    int advice);
+
+static int map_fd(int fd, size_t len, struct file_map *map, int advice);
+
+static int read_file(char *path, struct file_map *map, struct stat *st,
+                     size_t max);
+
+static int read_fd(int fd, size_t len, struct file_map *map);
+
+static void unmap_file(struct file_map *map);
+
+static int open_temp(char *dest, mode_t mode, char **temp);
+
+static int finish_temp(int fd, char *temp, char *dest, int ret);
+
+static void *gc_sweep(void *arg);
+
+static int gc_sweep_object(struct helper *helper, char *objects, char *name,
+                                                  struct timespec *start,
+                                                  size_t *bytes);
+
+static void gc_keep(struct helper *helper, uint64_t digest);
+
+static void gc_stop(struct helper *helper);
+
+static int parse_object_name(const char *name, uint64_t *digest, int *is_delta);
+
+static int journal_write_prune(struct helper *helper, struct commit **commits,
+                                                      size_t n);
+
+static void digest_set_add(struct digest_set *set, uint64_t digest);
+
+static int digest_set_has(struct digest_set *set, uint64_t digest);
+
+static int read_delta_header(char *path, struct delta_header *header);
+
+static void reader_delta_header(struct byte_reader *r,
+                                struct delta_header *header);
+
+static int sparse_matches(struct helper *helper, const char *name);
+
+static int not_in_workspace(struct tracked_file *file);
+
+static int lazy_taken(struct helper *helper, struct tracked_file *file);
+
+static void sparse_set(struct helper *helper, char **patterns, size_t n);
+
+static int journal_write_sparse(struct helper *helper, char **patterns,
+                                size_t n);
+
+void *svc_init(void) {
     // Make the directory where the commits will be stored
     char address[14] = "svc_commits_a";
     while(mkdir(address, 0777)) {
         // Changing the address until it reaches one that doesn't already exist
         address[12] = address[12] + 1;
     }
+    // Create the helper
+    struct helper *h = helper_new(address);
+    // Make the object store where file contents are kept
+    char *arr[] = {address, "/", OBJECTS_DIR};
+    char *objects = str_concat(arr, 3);
+    if(objects == NULL || mkdir(objects, 0777) != 0) {
+        exit(1); // An error has occurred
+    }
+    free(objects);
+    // Start the journal that lets the repository be opened again
+    if(journal_create(h) != 0) {
+        exit(1); // An error has occurred
+    }
+    return h;
+}
+
+// Helper function to create a helper for the repository in dir, with just
+// an empty master branch
+static struct helper *helper_new(char *dir) {
+    struct helper *h = malloc(sizeof(struct helper));
+    if(h == NULL) {
+        exit(1); // An error has occurred
+    }
     // Store the directory in helper
-    h->dir = malloc(sizeof(char)*14);
+    h->dir = malloc(sizeof(char) * (strlen(dir) + 1));
     if(h->dir == NULL) {
         exit(1); // An error has occurred
     }
-    strcpy(h->dir, address);
+    strcpy(h->dir, dir);
 
     // Initialise rest of fields
     h->commits = NULL;
     h->n_commits = 0;
-    h->n_branches = 1;
-
-    // Setup the master branch
-    h->branches = malloc(sizeof(struct branch*));
-    if(h->branches == NULL) {
+    h->commit_index = NULL;
+    h->commit_index_size = 0;
+    h->branches = NULL;
+    h->n_branches = 0;
+    h->branch_index = NULL;
+    h->branch_index_size = 0;
+    h->sorted_branches = NULL;
+    h->reach_words = 0;
+    h->strong_hash = 0;
+    h->n_threads = 0;
+    h->pool = NULL;
+    h->journal_fd = -1;
+    h->tree_gen = 0;
+    h->compress_level = SVC_COMPRESS_LEVEL;
+    memset(&h->gc, 0, sizeof(h->gc));
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    // Sweeps are paced by the monotonic clock
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    if(pthread_mutex_init(&h->gc.lock, NULL) != 0 ||
+       pthread_cond_init(&h->gc.wake, &attr) != 0) {
         exit(1); // An error has occurred
     }
+    pthread_condattr_destroy(&attr);
+    h->sparse = NULL;
+    h->n_sparse = 0;
+    h->lazy = 0;
+    h->journal_map = NULL;
+    h->journal_map_len = 0;
+    h->checkpoint_map = NULL;
+    h->checkpoint_len = 0;
+    h->checkpoint_commits = 0;
+    h->journal_last = 0;
+    memset(&h->arena, 0, sizeof(h->arena));
+    memset(&h->paths, 0, sizeof(h->paths));
+
+    // Setup the master branch
     struct branch *master = malloc(sizeof(struct branch));
     if(master == NULL){
         exit(1); // An error has occurred
@@ -46,7 +588,12 @@ void *svc_init(void) {
     master->head = NULL;
     master->files = NULL;
     master->n_files = 0;
-    h->branches[0] = master;
+    master->files_cap = 0;
+    master->file_index = NULL;
+    master->file_index_size = 0;
+    master->seq = 0;
+    master->stage = 0;
+    branch_register(h, master);
     // Set current branch to master
     h->current_branch = h->branches[0];
     return h;
@@ -55,44 +602,91 @@ void *svc_init(void) {
 void cleanup(void *helper) {
     struct helper *h = (struct helper *)helper;
 
+    // Stop removing objects before everything is removed
+    gc_stop(h);
     // Remove files that were created
-    char *t_arr[] = {"rm -r ", h->dir};
-    char *command = str_concat(t_arr, 2);
-    if(command == NULL) {
-        return; // An error has occurred
+    remove_tree(h->dir);
+    free_helper(h);
+}
+
+// Close a repository without deleting it, so it can be opened again with
+// svc_open. Uncommitted changes and file signatures are saved as well
+int svc_close(void *helper) {
+    if(helper == NULL) {
+        return -1; // Defensive checks
+    }
+    struct helper *h = (struct helper *)helper;
+    int ret = 0;
+    // Save each branch's tracked files
+    for(size_t i = 0; i < h->n_branches; i++) {
+        if(journal_write_stage(h, h->branches[i]) != 0) {
+            ret = -1; // An error has occurred
+        }
     }
-    if(system(command) != 0) {
-        return; // An error has occurred
+    if(fsync(h->journal_fd) != 0) {
+        ret = -1; // An error has occurred
     }
-    free(command);
+    // Let the next svc_open start from here, unless nothing was committed
+    // since the last checkpoint
+    if(ret == 0 && h->n_commits != h->checkpoint_commits
+       && checkpoint_write(h) != 0) {
+        ret = -1; // An error has occurred
+    }
+    free_helper(h);
+    return ret;
+}
 
-    // Free the commits
-    for(size_t i = 0; i < h->n_commits; i++) {
-        // Free the commit message
-        free(h->commits[i]->message);
-        // Free the files in each commit
-        for(size_t j = 0; j < h->commits[i]->n_files; j++) {
-            free(h->commits[i]->files[j].file_name);
+// Helper function to free a helper and everything it owns
+static void free_helper(struct helper *h) {
+    // Stop the garbage collector, which uses the repository's directory
+    gc_stop(h);
+    pthread_mutex_destroy(&h->gc.lock);
+    pthread_cond_destroy(&h->gc.wake);
+
+    // Free the lists of commits. The commits themselves are in the arena, and
+    // only branch heads have bitmaps
+    for(size_t i = 0; i < h->n_branches; i++) {
+        struct commit *head = h->branches[i]->head;
+        if(head != NULL) {
+            free(head->reach);
+            head->reach = NULL;
         }
-        free(h->commits[i]->files);
-        // Free parents array
-        free(h->commits[i]->parents);
-        free(h->commits[i]);
     }
     free(h->commits);
+    free(h->commit_index);
 
-    // Free the branches
+    // Free the branches. Their file names are in the arena
     for(size_t i = 0; i < h->n_branches; i++) {
         free(h->branches[i]->branch_name);
-        // Free the files
-        for(size_t j = 0; j < h->branches[i]->n_files; j++) {
-            free(h->branches[i]->files[j].file_name);
-        }
         free(h->branches[i]->files);
+        free(h->branches[i]->file_index);
         free(h->branches[i]);
     }
     free(h->branches);
+    free(h->branch_index);
+    free(h->sorted_branches);
 
+    // Stop the worker threads
+    pool_destroy(h->pool);
+    // Free the commits and path names all at once
+    free(h->paths.slots);
+    free(h->paths.paths);
+    arena_free(&h->arena);
+    if(h->journal_fd != -1) {
+        close(h->journal_fd);
+    }
+    // Commits read back by svc_open point into these
+    if(h->journal_map != NULL) {
+        munmap(h->journal_map, h->journal_map_len);
+    }
+    if(h->checkpoint_map != NULL) {
+        munmap(h->checkpoint_map, h->checkpoint_len);
+    }
+    // Free the sparse patterns
+    for(size_t i = 0; i < h->n_sparse; i++) {
+        free(h->sparse[i]);
+    }
+    free(h->sparse);
     // Free the directory string
     free(h->dir);
     // Free h
@@ -100,6 +694,105 @@ void cleanup(void *helper) {
 }
 
 int hash_file(void *helper, char *file_path) {
+    return hash_file_digest(helper, file_path, NULL, NULL);
+}
+
+// Turn the strong digest kept alongside the legacy hash on or off
+void svc_set_strong_hash(void *helper, int enabled) {
+    if(helper == NULL) {
+        return; // Defensive checks
+    }
+    ((struct helper *)helper)->strong_hash = enabled;
+}
+
+// Set the zstd level that delta instructions are compressed with, or 0 to
+// store them as they are. Only used when built with SVC_USE_ZSTD
+void svc_set_compression(void *helper, int level) {
+    if(helper == NULL || level < 0) {
+        return; // Defensive checks
+    }
+    ((struct helper *)helper)->compress_level = level;
+}
+
+// Helper function to rehash a tracked file, keeping its digest up to date
+static void hash_tracked_file(struct helper *helper,
+                              struct tracked_file *file) {
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    if(helper->strong_hash) {
+        file->digest = 0;
+        file->hash = hash_file_digest(helper, file->path->name,
+                                                &file->digest, &st);
+    } else {
+        int old_hash = file->hash;
+        file->hash = hash_file_digest(helper, file->path->name, NULL, &st);
+        // The digest only stays valid while the contents look the same
+        if(file->hash != old_hash) {
+            file->digest = 0;
+        }
+    }
+    // Remember what the file looked like when it was hashed
+    cache_from_stat(&file->cache, &st);
+}
+
+// Helper function to remember a file's stat signature
+static void cache_from_stat(struct file_cache *cache, struct stat *st) {
+    cache->size = st->st_size;
+    cache->inode = st->st_ino;
+    cache->mtime_ns = (int64_t)st->st_mtim.tv_sec * 1000000000
+                    + st->st_mtim.tv_nsec;
+    cache->ctime_ns = (int64_t)st->st_ctim.tv_sec * 1000000000
+                    + st->st_ctim.tv_nsec;
+    // A file written again within one timestamp tick of being hashed could
+    // keep the same size and times, so don't trust it until both times are
+    // a whole tick behind the clock
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    int64_t racy = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec
+                 - RACY_WINDOW_NS;
+    if(cache->mtime_ns >= racy || cache->ctime_ns >= racy) {
+        cache->inode = 0;
+    }
+}
+
+// Helper function to check whether a file still looks the way it did when
+// its signature was cached. If it does, its hash cannot have changed
+static int cache_matches(struct file_cache *cache, struct stat *st) {
+    return cache->inode != 0 && cache->inode == st->st_ino
+        && cache->size == st->st_size
+        && cache->mtime_ns == (int64_t)st->st_mtim.tv_sec * 1000000000
+                              + st->st_mtim.tv_nsec
+        && cache->ctime_ns == (int64_t)st->st_ctim.tv_sec * 1000000000
+                              + st->st_ctim.tv_nsec;
+}
+
+// Helper function to check that a tracked file in the workspace still holds
+// the contents it was last hashed or restored with. A file with no trusted
+// signature is hashed again, and keeps the new signature if it matches
+static int file_unchanged(struct helper *helper, struct tracked_file *file,
+                                                 struct stat *st) {
+    if(cache_matches(&file->cache, st)) {
+        return 1;
+    }
+    if(file->cache.inode != 0) {
+        return 0; // Its signature has changed
+    }
+    uint64_t digest = 0;
+    struct stat now;
+    int hash = hash_file_digest(helper, file->path->name,
+                                file->digest != 0 ? &digest : NULL, &now);
+    if(hash < 0 || !same_contents(file->hash, file->digest, hash, digest)) {
+        return 0;
+    }
+    cache_from_stat(&file->cache, &now);
+    return 1;
+}
+
+// Hashes a file a block at a time. Gives the same result as the original
+// byte by byte algorithm, and also computes the strong digest if asked.
+// If st is given, it is filled in from the file before it is read
+static int hash_file_digest(void *helper, char *file_path, uint64_t *digest,
+                                                           struct stat *st) {
     if(helper == NULL) {
         return -1; // Error
     }
@@ -110,149 +803,343 @@ int hash_file(void *helper, char *file_path) {
         return -2; // Cannot access == file does not exist
     }
     //File I/O
-    FILE *f_ptr;
-    f_ptr = fopen(file_path, "rb");
-    if(f_ptr == NULL) {
+    int fd = open(file_path, O_RDONLY);
+    if(fd == -1) {
         return -1; // Error occurred when opening file
     }
+    struct stat own;
+    if(st == NULL) {
+        st = &own;
+    }
+    if(fstat(fd, st) != 0) {
+        close(fd);
+        return -1; // An error has occurred
+    }
 
     // Begin the hash algorithm
     int hash = 0;
-    char buff;
     // Add up the bytes in the name
     for(unsigned int i = 0; i < strlen(file_path); i++) {
         hash += (unsigned char) file_path[i];
     }
     //Calculating modulus once is same as doing each time but faster
     hash %= 1000;
-    // Add up the bytes in the file
-    // While we have not reached EOF or an error
-    while(fread(&buff, 1, 1, f_ptr)) {
-        hash += (unsigned char) buff;
+    struct digest_state state;
+    if(digest != NULL) {
+        digest_init(&state);
     }
+    // Add up the bytes in the file one block at a time. Workspace files are
+    // never mapped, as one cut short while it was being hashed would make
+    // reading the mapping past its new end raise SIGBUS
+    uint64_t total = 0;
+    unsigned char *buff = malloc(HASH_BLOCK_SIZE);
+    if(buff == NULL) {
+        close(fd);
+        return -1; // An error has occurred
+    }
+    ssize_t n;
+    while((n = read(fd, buff, HASH_BLOCK_SIZE)) != 0) {
+        if(n == -1) {
+            if(errno == EINTR) {
+                continue; // Interrupted, try again
+            }
+            break; // Stop at an error, as the original algorithm did
+        }
+        total += sum_bytes(buff, n);
+        if(digest != NULL) {
+            digest_update(&state, buff, n);
+        }
+    }
+    free(buff);
+    // The original summed into an int one byte at a time, which wraps
+    hash = (int)((unsigned int)hash + (unsigned int)total);
     hash %= 2000000000;
+    if(digest != NULL) {
+        *digest = digest_final(&state);
+    }
 
-    fclose(f_ptr);
+    close(fd);
     return hash;
 }
 
-char *svc_commit(void *helper, char *message) {
-    if(helper == NULL || message == NULL) {
-        return NULL; // An error has occurred
+// Helper function to add up every byte in a buffer
+static uint64_t sum_bytes(const unsigned char *buff, size_t len) {
+    uint64_t sum = 0;
+    size_t i = 0;
+#if defined(__AVX2__)
+    // Sum of absolute differences against zero adds up 8 bytes per lane
+    __m256i zero_256 = _mm256_setzero_si256();
+    __m256i acc_256 = _mm256_setzero_si256();
+    for(; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buff + i));
+        acc_256 = _mm256_add_epi64(acc_256, _mm256_sad_epu8(v, zero_256));
     }
-    struct helper *h = (struct helper *)helper;
-    struct branch *branch = h->current_branch;
-
-    // Update files being tracked but are no longer accessible
-    check_changes(helper); // Check for files that are no longer accessible
-    for(size_t i = 0; i < branch->n_files; i++) {
-        char c = branch->files[i].change;
-        // These files were added but are no longer accessible
-        if(c == 'a') {
-            branch->files[i].change = 'c'; // Mark for removal
-        }
-        // These files were being tracked but are no longer accessible
-        if(c == 'd') {
-            branch->files[i].change = 'D'; // Mark as a deletion
-        }
+    uint64_t lanes_256[4];
+    _mm256_storeu_si256((__m256i *)lanes_256, acc_256);
+    sum += lanes_256[0] + lanes_256[1] + lanes_256[2] + lanes_256[3];
+#endif
+#if defined(__SSE2__)
+    __m128i zero = _mm_setzero_si128();
+    __m128i acc = _mm_setzero_si128();
+    for(; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buff + i));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(v, zero));
     }
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *)lanes, acc);
+    sum += lanes[0] + lanes[1];
+#endif
+    // Add whatever is left over (or everything without SIMD support)
+    for(; i < len; i++) {
+        sum += buff[i];
+    }
+    return sum;
+}
 
-    // Check if there are changes to be committed
-    if(!check_changes(helper)){
-        return NULL; // No changes to be committed
+// The strong digest is XXH64 with a seed of 0
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t digest_round(uint64_t acc, uint64_t input) {
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static uint64_t digest_merge_round(uint64_t acc, uint64_t val) {
+    acc ^= digest_round(0, val);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+static void digest_init(struct digest_state *state) {
+    state->v[0] = PRIME64_1 + PRIME64_2;
+    state->v[1] = PRIME64_2;
+    state->v[2] = 0;
+    state->v[3] = -PRIME64_1;
+    state->mem_size = 0;
+    state->total_len = 0;
+}
+
+static void digest_update(struct digest_state *state,
+                          const unsigned char *buff, size_t len) {
+    state->total_len += len;
+    // Not enough for a full stripe yet, just remember the bytes
+    if(state->mem_size + len < 32) {
+        memcpy(state->mem + state->mem_size, buff, len);
+        state->mem_size += len;
+        return;
     }
+    // Finish off the stripe left over from last time
+    if(state->mem_size > 0) {
+        size_t fill = 32 - state->mem_size;
+        memcpy(state->mem + state->mem_size, buff, fill);
+        for(int i = 0; i < 4; i++) {
+            state->v[i] = digest_round(state->v[i], read64(state->mem + i*8));
+        }
+        buff += fill;
+        len -= fill;
+        state->mem_size = 0;
+    }
+    // Process whole 32 byte stripes
+    while(len >= 32) {
+        for(int i = 0; i < 4; i++) {
+            state->v[i] = digest_round(state->v[i], read64(buff + i*8));
+        }
+        buff += 32;
+        len -= 32;
+    }
+    // Keep the rest for next time
+    memcpy(state->mem, buff, len);
+    state->mem_size = len;
+}
 
-    // Create a new commit
-    struct commit *commit = malloc(sizeof(struct commit));
-    if(commit == NULL) {
-        return NULL; // An error has occurred
+static uint64_t digest_final(struct digest_state *state) {
+    uint64_t h;
+    if(state->total_len >= 32) {
+        h = rotl64(state->v[0], 1) + rotl64(state->v[1], 7)
+          + rotl64(state->v[2], 12) + rotl64(state->v[3], 18);
+        for(int i = 0; i < 4; i++) {
+            h = digest_merge_round(h, state->v[i]);
+        }
+    } else {
+        h = state->v[2] + PRIME64_5;
     }
-    // Copy the commit message
-    commit->message = malloc(sizeof(char)*(strlen(message) + 1));
-    if(commit->message == NULL) {
-        return NULL; // An error has occurred
+    h += state->total_len;
+    // Mix in the bytes that did not make up a full stripe
+    const unsigned char *p = state->mem;
+    size_t len = state->mem_size;
+    while(len >= 8) {
+        h ^= digest_round(0, read64(p));
+        h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+        p += 8;
+        len -= 8;
     }
-    strcpy(commit->message, message);
-    // Set the commit's branch to the current branch
-    commit->branch = branch;
+    if(len >= 4) {
+        uint32_t k;
+        memcpy(&k, p, sizeof(k));
+        h ^= (uint64_t)k * PRIME64_1;
+        h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+        len -= 4;
+    }
+    while(len > 0) {
+        h ^= (*p) * PRIME64_5;
+        h = rotl64(h, 11) * PRIME64_1;
+        p++;
+        len--;
+    }
+    // Final avalanche
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
 
-    // Need to remove files marked as deleted from tracked files after commit
-    // An array to mark files for removal from tracked files
-    int *rem_list = malloc(sizeof(int) * branch->n_files);
-    if(rem_list == NULL) {
+char *svc_commit(void *helper, char *message) {
+    if(helper == NULL || message == NULL) {
         return NULL; // An error has occurred
     }
-    int rem_count = 0;
+    return make_commit(helper, message, NULL);
+}
+
+// Helper function to commit the current branch. If merged is given, it
+// becomes the second parent of the commit
+static char *make_commit(struct helper *h, char *message,
+                         struct commit *merged) {
+    struct branch *branch = h->current_branch;
+
+    // Update files being tracked but are no longer accessible
+    check_changes(h); // Check for files that are no longer accessible
     for(size_t i = 0; i < branch->n_files; i++) {
-        rem_list[i] = 0;
+        char c = branch->files[i].change;
+        // These files were added but are no longer accessible
+        if(c == 'a') {
+            branch->files[i].change = 'c'; // Mark for removal
+        }
+        // These files were being tracked but are no longer accessible
+        if(c == 'd') {
+            branch->files[i].change = 'D'; // Mark as a deletion
+        }
+    }
+
+    // Check if there are changes to be committed
+    if(!check_changes(h)){
+        return NULL; // No changes to be committed
     }
 
-    // Copy the tracked files
-    commit->files = malloc(sizeof(struct tracked_file) * branch->n_files);
-    if(commit->files == NULL) {
-        return NULL; //An error has occurred
+    // Find the hash of newly added files, and the digest naming the blob of
+    // every changed file. This does not change what is tracked, so it is
+    // safe to do before the snapshot is taken
+    size_t *jobs = malloc(sizeof(size_t) * (branch->n_files + 1));
+    if(jobs == NULL) {
+        return NULL; // An error has occurred
     }
-    // For each file...
+    size_t n_jobs = 0;
     for(size_t i = 0; i < branch->n_files; i++) {
-        // ...copy the file name
-        commit->files[i].file_name = malloc(sizeof(char) *
-                                     (strlen(branch->files[i].file_name) + 1));
-        if(commit->files[i].file_name == NULL) {
-            return NULL; // An error has occurred
+        char c = branch->files[i].change;
+        if(c == 'A' || (c == 'M' && branch->files[i].digest == 0)) {
+            jobs[n_jobs++] = i;
         }
-        strcpy(commit->files[i].file_name, branch->files[i].file_name);
+    }
+    struct hash_job_args args = {h, branch->files, jobs, NULL, NULL};
+    parallel_for(h, n_jobs, commit_hash_job, &args);
+    free(jobs);
+
+    // Create a new commit. It lives in the arena until cleanup, even if it
+    // ends up not being made
+    struct commit *commit = arena_alloc(&h->arena, sizeof(struct commit));
+    // Copy the commit message
+    commit->message = arena_strdup(&h->arena, message, strlen(message));
+    // Set the commit's branch to the current branch
+    commit->branch = branch;
+    commit->parents = NULL;
+    commit->n_parents = 0;
+    commit->pruned = 0;
+    commit->heads = 0;
+    commit->reach = NULL;
+    commit->reach_words = 0;
+    commit->unread = 0;
+    commit->no_base = branch->head == NULL;
+    commit->record = 0;
+    commit->listed = 0;
+    commit->listing = 0;
 
+    // Copy the changed files. Unchanged files are shared with the parent
+    size_t n_changed = 0;
+    for(size_t i = 0; i < branch->n_files; i++) {
+        char c = branch->files[i].change;
+        if(c == 'A' || c == 'M' || c == 'D') {
+            n_changed++;
+        }
+    }
+    commit->n_files = 0;
+    commit->files = arena_alloc(&h->arena,
+                                sizeof(struct tracked_file) * n_changed);
+    // For each changed file...
+    for(size_t i = 0; i < branch->n_files; i++) {
+        char c = branch->files[i].change;
+        if(c != 'A' && c != 'M' && c != 'D') {
+            continue; // Otherwise the change is none
+        }
+        struct tracked_file *file = &commit->files[commit->n_files++];
+        // ...share the file's path
+        file->path = branch->files[i].path;
         // Set the change made and hash
-        if(branch->files[i].change == 'A') {
-            // If change is addition, find the hash
-            commit->files[i].change = 'A';
-            commit->files[i].hash = hash_file(helper,
-                                    commit->files[i].file_name);
-            // Update the tracked file to show no change
-            branch->files[i].change = 'N';
-            // Update the hash to the most recent one
-            branch->files[i].hash = commit->files[i].hash;
-        } else if(branch->files[i].change == 'D') {
+        file->change = c;
+        if(c == 'D') {
             // If change is deletion, set hash to -2
-            commit->files[i].change = 'D';
-            commit->files[i].hash = -2;
-            // Mark for removal from tracked files
-            rem_list[i] = 1;
-            rem_count++;
-        } else if(branch->files[i].change == 'M') {
-            // If change is modification, copy hash
-            commit->files[i].change = 'M';
-            commit->files[i].hash = branch->files[i].hash;
-            // Update the tracked file to show no change
-            branch->files[i].change = 'N';
+            file->hash = -2;
+            file->digest = 0;
+            file->cache.inode = 0;
         } else {
-            // Otherwise file is set to no changes currently
-            commit->files[i].change = 'N';
-            commit->files[i].hash = branch->files[i].hash;
+            file->hash = branch->files[i].hash;
+            file->digest = branch->files[i].digest;
+            file->cache = branch->files[i].cache;
         }
     }
 
-    // Set the file count
-    commit->n_files = branch->n_files;
-
-    // Remove files marked for deletion
-    remove_tracked_files(branch, rem_list, rem_count);
-    free(rem_list);
-
     // Set parents
-    if(branch->head == NULL) {
-        commit->parents = NULL; // No parents if no previous commits
-        commit->n_parents = 0;
-    } else {
+    if(branch->head != NULL || merged != NULL) {
+        commit->parents = arena_alloc(&h->arena, sizeof(struct commit*) * 2);
         // Set parent to current commit
-        commit->parents = malloc(sizeof(struct commit*));
-        commit->parents[0] = branch->head;
-        commit->n_parents = 1;
+        if(branch->head != NULL) {
+            commit->parents[commit->n_parents++] = branch->head;
+        }
+        // Followed by the commit that was merged in
+        if(merged != NULL) {
+            commit->parents[commit->n_parents++] = merged;
+        }
     }
-    // Set the commit id
+    commit->generation = commit_generation(commit);
+    // Set the commit id, which also sorts the changes
     set_commit_id(commit);
-    // Update the branch's current commit to this one
-    branch->head = commit;
+    // The tracked files are the branch's last commit with the changes made
+    commit->tree = tree_apply(h, commit_tree(h, branch->head), commit);
+    commit->tree_ready = 1;
+
+    // Create a snapshot of the files and record the commit in the journal.
+    // Nothing has been changed yet, so if this fails the branch is left
+    // exactly as it was
+    commit->seq = h->n_commits;
+    if(snapshot_commit(h, commit) != 0 || journal_write_commit(h, commit)) {
+        return NULL; // An error has occurred
+    }
+
     // Add commit to the commit list in helper
     struct commit **temp = realloc(h->commits,
                            sizeof(struct commit *) * (h->n_commits + 1));
@@ -262,926 +1149,5109 @@ char *svc_commit(void *helper, char *message) {
     h->commits = temp;
     h->commits[h->n_commits] = commit;
     h->n_commits++;
+    commit_index_insert(h, commit);
+    // Everything the parents reach, plus the commit itself. The parents are
+    // branch heads, so this is normally just combining their bitmaps, and is
+    // done before the old head's is freed
+    size_t reach_words = 0;
+    uint64_t *reach = reach_build(h, commit, &reach_words);
+    // Update the branch's current commit to this one
+    branch_set_head(h, branch, commit);
+    commit->reach = reach;
+    commit->reach_words = reach_words;
+    h->reach_words += reach_words;
 
-    // Create a snapshot of the files
-    // Make a directory for the commit
-    char *temp_arr[] = {h->dir, "/", commit->id};
-    char *address = str_concat(temp_arr, 3);
-    if(address == NULL) {
-        return NULL; // An error has occurred
+    // Need to remove files marked as deleted from tracked files after commit
+    // An array to mark files for removal from tracked files
+    int *rem_list = malloc(sizeof(int) * branch->n_files);
+    if(rem_list == NULL && branch->n_files > 0) {
+        exit(1); // An error has occurred
     }
-    if(mkdir(address, 0777) != 0) {
-        return NULL; // An error has occurred
+    int rem_count = 0;
+    for(size_t i = 0; i < branch->n_files; i++) {
+        rem_list[i] = 0;
+        char c = branch->files[i].change;
+        if(c == 'D') {
+            // Mark for removal from tracked files
+            rem_list[i] = 1;
+            rem_count++;
+        } else if(c == 'A' || c == 'M') {
+            // Update the tracked file to show no change
+            branch->files[i].change = 'N';
+        }
     }
+    // Remove files marked for deletion
+    remove_tracked_files(branch, rem_list, rem_count);
+    free(rem_list);
+    // A checkpoint only saves time when opening, so if it cannot be written
+    // the next one is tried after the next commit
+    if(checkpoint_due(h)) {
+        checkpoint_write(h);
+    }
+    return commit->id;
+}
 
-    // Make a copy of each file in the commit that has been changed
+// Helper function to store the contents of each file a commit changed
+static int snapshot_commit(struct helper *helper, struct commit *commit) {
+    size_t *jobs = malloc(sizeof(size_t) * (commit->n_files + 1));
+    int *results = malloc(sizeof(int) * (commit->n_files + 1));
+    if(jobs == NULL || results == NULL) {
+        free(jobs);
+        free(results);
+        return -1; // An error has occurred
+    }
+    size_t n_jobs = 0;
     for(size_t i = 0; i < commit->n_files; i++) {
         if(commit->files[i].change == 'A' || commit->files[i].change == 'M') {
-            // Create a string for the shell command that copies the file...
-            // ... to the new directory
-            char *t_arr[] = {"cp --parents \"", commit->files[i].file_name,
-                                                            "\" ", address};
-            char *command = str_concat(t_arr, 4);
-            if(command == NULL) {
-                return NULL; // An error has occurred
-            }
-            // Execute the command
-            if(system(command) != 0) {
-                return NULL; // An error has occurred
+            jobs[n_jobs++] = i;
+        }
+    }
+    // Store the blobs in parallel. Modified files are stored as deltas
+    // against their contents in the previous commit when that is smaller.
+    // Every job looks in that commit's tree, so it is built here first
+    struct commit *parent = commit->n_parents > 0 ? commit->parents[0] : NULL;
+    commit_tree(helper, parent);
+    struct hash_job_args args = {helper, commit->files, jobs, results, parent};
+    parallel_for(helper, n_jobs, store_job, &args);
+    // Then make the full copies that are left in one batch
+    struct copy_job *copies = malloc(sizeof(struct copy_job) * (n_jobs + 1));
+    if(copies == NULL) {
+        exit(1); // An error has occurred
+    }
+    size_t n_copies = 0;
+    int ret = 0;
+    for(size_t i = 0; i < n_jobs; i++) {
+        if(results[i] == 1) {
+            struct tracked_file *file = &commit->files[jobs[i]];
+            struct copy_job *copy = &copies[n_copies++];
+            copy->source = file->path->name;
+            copy->dest = blob_path(helper, file->digest);
+            copy->cache = NULL;
+            if(copy->dest == NULL) {
+                exit(1); // An error has occurred
             }
-            free(command);
+        } else if(results[i] != 0) {
+            ret = -1; // An error has occurred
         }
     }
-    free(address);
-    return commit->id;
+    // Blobs already stored are harmless if one fails, they are only named
+    // by their contents and nothing refers to them yet
+    if(ret == 0 && copy_files(helper, copies, n_copies) != 0) {
+        ret = -1; // An error has occurred
+    }
+    for(size_t i = 0; i < n_copies; i++) {
+        free(copies[i].dest);
+    }
+    free(copies);
+    free(jobs);
+    free(results);
+    return ret;
 }
 
-void *get_commit(void *helper, char *commit_id) {
-    if(helper == NULL || commit_id == NULL) {
-        return NULL; // Defensive checks
-    }
-    struct helper *h = (struct helper*)helper;
-    // Look for the commit
-    for(size_t i = 0; i < h->n_commits; i++) {
-        if(strcmp(h->commits[i]->id, commit_id) == 0) {
-            // Found the commit
-            return h->commits[i];
+// Helper function to store the blob for one job of snapshot_commit
+static void store_job(void *arg, size_t i) {
+    struct hash_job_args *args = arg;
+    struct tracked_file *file = &args->files[args->positions[i]];
+    // Find the contents the file had before, if it had any
+    uint64_t base = 0;
+    if(file->change == 'M' && args->parent != NULL) {
+        struct tree_node *node = find_commit_file(args->helper, args->parent,
+                                                  file->path);
+        if(node != NULL) {
+            base = node->digest;
         }
     }
-    // Otherwise, not found
-    return NULL;
+    args->results[i] = store_blob(args->helper, file, base);
 }
 
-char **get_prev_commits(void *helper, void *commit, int *n_prev) {
-    if(n_prev == NULL || helper == NULL) {
-        return NULL; // An error has occurred
+// Helper function to copy one file back from its blob for svc_merge
+static void restore_job(void *arg, size_t i) {
+    struct hash_job_args *args = arg;
+    struct tracked_file *file = &args->files[args->positions[i]];
+    args->results[i] = restore_file(args->helper, file, &file->cache);
+}
+
+// Helper function to add a file's contents to the object store. Contents
+// that are already stored are not written again. If base is the digest of
+// an earlier version of the file, a delta against it is tried first.
+// Returns 0 if stored, 1 if a full copy still has to be made, so copies can
+// be batched by copy_files, or -1 if an error occurs
+static int store_blob(struct helper *helper, struct tracked_file *file,
+                                              uint64_t base) {
+    // Make sure a running garbage collection does not remove it
+    gc_keep(helper, file->digest);
+    if(object_exists(helper, file->digest)) {
+        return 0; // Already stored
     }
-    if(commit == NULL) {
-        *n_prev = 0;
-        return NULL;
+    // Deltas are always made against a full copy, so a file is never more
+    // than one delta away from being rebuilt
+    if(base != 0) {
+        base = object_base(helper, base);
+        gc_keep(helper, base);
     }
-    struct commit *c = (struct commit *)commit;
-    if( c->n_parents == 0) {
-        *n_prev = 0;
-        return NULL;
+    if(base != 0 && store_delta(helper, file, base) == 0) {
+        return 0;
     }
-    *n_prev = c->n_parents;
-    // Create the array
-    char **arr = malloc(sizeof(char*)*c->n_parents);
-    if(arr == NULL) {
-        return NULL; // An error has occurred
+    // Otherwise a full copy is needed
+    return 1;
+}
+
+// Helper function to find where the blob with the given digest is stored
+static char *blob_path(struct helper *helper, uint64_t digest) {
+    char name[17];
+    sprintf(name, "%016llx", (unsigned long long)digest);
+    char *arr[] = {helper->dir, "/", OBJECTS_DIR, "/", name};
+    return str_concat(arr, 5);
+}
+
+// Helper function to find where the delta with the given digest is stored
+static char *delta_path(struct helper *helper, uint64_t digest) {
+    char name[17];
+    sprintf(name, "%016llx", (unsigned long long)digest);
+    char *arr[] = {helper->dir, "/", OBJECTS_DIR, "/", name, DELTA_SUFFIX};
+    return str_concat(arr, 6);
+}
+
+// Helper function to check if contents are stored, either in full or as a
+// delta
+static int object_exists(struct helper *helper, uint64_t digest) {
+    char *full = blob_path(helper, digest);
+    char *delta = delta_path(helper, digest);
+    int found = (full != NULL && access(full, F_OK) == 0) ||
+                (delta != NULL && access(delta, F_OK) == 0);
+    free(full);
+    free(delta);
+    return found;
+}
+
+// Helper function to find the full copy that stored contents are rebuilt
+// from, which is the contents themselves unless they are a delta. Returns 0
+// if there is none
+static uint64_t object_base(struct helper *helper, uint64_t digest) {
+    char *full = blob_path(helper, digest);
+    if(full == NULL) {
+        return 0; // An error has occurred
     }
-    // Copy a pointer to the parents id to the array
-    for(size_t i = 0; i < c->n_parents; i++) {
-        arr[i] = c->parents[i]->id;
+    int found = access(full, F_OK) == 0;
+    free(full);
+    if(found) {
+        return digest;
     }
-    return arr;
+    char *path = delta_path(helper, digest);
+    struct delta_header header;
+    found = path != NULL && read_delta_header(path, &header) == 0;
+    free(path);
+    return found ? header.base : 0;
 }
 
-void print_commit(void *helper, char *commit_id) {
-    struct commit *commit = get_commit(helper, commit_id);
-    // Defensive checks
-    if(commit == NULL) {
-        puts("Invalid commit id");
-        return;
+// Helper function to store a file as a delta against the full copy with
+// digest base. Returns 1 if the delta would not be much smaller than the
+// file, so a full copy should be stored instead
+static int store_delta(struct helper *helper, struct tracked_file *file,
+                                              uint64_t base) {
+    char *base_path = blob_path(helper, base);
+    if(base_path == NULL) {
+        return -1; // An error has occurred
     }
-    printf("%s [%s]: %s\n",
-            commit->id, commit->branch->branch_name, commit->message);
-    char c;
-    // Keep track of how many files are being tracked and not removed
-    int count = 0;
-    for(size_t i = 0; i < commit->n_files; i++) {
-        c = commit->files[i].change;
-        if(c != 'D') {
-            count++;
+    // Matches are looked up all over the base, which is a stored object and
+    // can be mapped. The file is in the workspace, so it is read instead.
+    // The file is held in memory and the whole base is indexed, so files
+    // and bases larger than DELTA_MAX_SIZE are left to be copied a block at
+    // a time
+    struct stat st;
+    struct file_map base_map;
+    struct file_map map;
+    int base_ok = stat(base_path, &st) == 0 && st.st_size <= DELTA_MAX_SIZE
+                  && map_file(base_path, &base_map, NULL, MADV_WILLNEED) == 0;
+    int ok = base_ok &&
+             read_file(file->path->name, &map, &st, DELTA_MAX_SIZE) == 0;
+    free(base_path);
+    int ret = 1;
+    if(ok) {
+        unsigned char *base_data = base_map.data;
+        size_t base_len = base_map.len;
+        unsigned char *data = map.data;
+        size_t len = map.len;
+        // Only keep the delta if it rebuilds exactly the contents the
+        // digest was taken of, in case the file has changed since
+        struct digest_state state;
+        digest_init(&state);
+        digest_update(&state, data, len);
+        struct byte_buffer ops = {NULL, 0, 0};
+        if(digest_final(&state) == file->digest &&
+           delta_encode(base_data, base_len, data, len, &ops, len / 2) == 0) {
+            struct delta_header header = {0, st.st_mode & 0777, base,
+                                          len, ops.len};
+            ret = write_delta(helper, file->digest, &header, &ops);
         }
-        // Substitute the change with the correct symbol
-        if(c != 'N') {
-            if(c == 'A') {
-                c = '+';
-            } else if (c == 'D') {
-                c = '-';
-            } else if (c == 'M') {
-                c = '/';
+        free(ops.data);
+    }
+    if(base_ok) {
+        unmap_file(&base_map);
+    }
+    if(ok) {
+        unmap_file(&map);
+    }
+    return ret;
+}
+
+// Helper function to work out the instructions that turn base into data.
+// Blocks of the base are indexed by a rolling hash, and each match found
+// in data is grown in both directions and copied rather than stored.
+// Returns 1, leaving out incomplete, if the instructions grow past limit
+static int delta_encode(const unsigned char *base, size_t base_len,
+                        const unsigned char *data, size_t len,
+                        struct byte_buffer *out, size_t limit) {
+    // Index where each block of the base starts, plus one so 0 is empty.
+    // A slot keeps the first block put in it, since a match is grown past
+    // the block anyway
+    size_t n_blocks = base_len / DELTA_BLOCK;
+    int bits = 4;
+    while(((size_t)1 << bits) < n_blocks * 2) {
+        bits++;
+    }
+    size_t *index = calloc((size_t)1 << bits, sizeof(size_t));
+    if(index == NULL) {
+        exit(1); // An error has occurred
+    }
+    for(size_t b = 0; b < n_blocks; b++) {
+        uint64_t hash = delta_block_hash(base + b * DELTA_BLOCK);
+        size_t slot = (hash * 0x9e3779b97f4a7c15ull) >> (64 - bits);
+        if(index[slot] == 0) {
+            index[slot] = b * DELTA_BLOCK + 1;
+        }
+    }
+    // Removes the byte leaving the window from the rolling hash
+    uint64_t out_factor = 1;
+    for(int k = 1; k < DELTA_BLOCK; k++) {
+        out_factor *= 0x100000001b3ull;
+    }
+
+    size_t i = 0;
+    size_t pending = 0; // Start of the bytes not yet in an instruction
+    uint64_t hash = len >= DELTA_BLOCK ? delta_block_hash(data) : 0;
+    while(i + DELTA_BLOCK <= len) {
+        size_t slot = (hash * 0x9e3779b97f4a7c15ull) >> (64 - bits);
+        size_t found = index[slot];
+        if(found != 0 && memcmp(base + found - 1, data + i,
+                                DELTA_BLOCK) == 0) {
+            // Grow the match back over bytes not yet stored, then forward
+            size_t start = i;
+            size_t offset = found - 1;
+            while(start > pending && offset > 0 &&
+                  base[offset - 1] == data[start - 1]) {
+                start--;
+                offset--;
             }
-            // If change was a modification
-            if(c == '/') {
-                // Find previous hash
-                int old_hash = 0;
-                for(size_t j = 0; j < commit->parents[0]->n_files; j++) {
-                    if(strcmp(commit->parents[0]->files[j].file_name,
-                              commit->files[i].file_name) == 0) {
-                        old_hash = commit->parents[0]->files[j].hash;
-                        break;
-                    }
-                }
-                printf("    %c %s [%10d -> %10d]\n",
-                c, commit->files[i].file_name, old_hash, commit->files[i].hash);
-            } else {
-                printf("    %c %s\n", c, commit->files[i].file_name);
+            size_t end = i + DELTA_BLOCK;
+            size_t base_end = offset + (end - start);
+            while(end < len && base_end < base_len &&
+                  base[base_end] == data[end]) {
+                end++;
+                base_end++;
+            }
+            delta_put_insert(out, data + pending, start - pending);
+            delta_put_copy(out, offset, end - start);
+            if(out->len > limit) {
+                free(index);
+                return 1; // Not worth storing as a delta
             }
+            i = pending = end;
+            if(i + DELTA_BLOCK <= len) {
+                hash = delta_block_hash(data + i);
+            }
+            continue;
         }
-    }
-    printf("\n    Tracked files (%d):\n", count);
-    for(size_t i = 0; i < commit->n_files; i++) {
-        c = commit->files[i].change;
-        if(c != 'D') {
-            printf("    [%10d] %s\n",
-            commit->files[i].hash, commit->files[i].file_name);
+        // Slide the window along one byte
+        if(i + DELTA_BLOCK < len) {
+            hash = (hash - data[i] * out_factor) * 0x100000001b3ull
+                   + data[i + DELTA_BLOCK];
         }
+        i++;
     }
+    delta_put_insert(out, data + pending, len - pending);
+    free(index);
+    return out->len > limit;
 }
 
-int svc_branch(void *helper, char *branch_name) {
-    if(branch_name == NULL) {
-        return -1;
+// Helper function to hash a block for delta_encode. Matches the rolling
+// hash of a window over the same bytes
+static uint64_t delta_block_hash(const unsigned char *data) {
+    uint64_t hash = 0;
+    for(int k = 0; k < DELTA_BLOCK; k++) {
+        hash = hash * 0x100000001b3ull + data[k];
     }
-    // Check if branch name is valid
-    for(size_t i = 0; i < strlen(branch_name); i++) {
-        char c = branch_name[i];
-        // Using ascii codes to check valid characters
-        if(!((c >= 97 && c <= 122) || (c >= 65 && c <= 90) ||
-              (c >= 48 && c <= 57) || c == '_' || c == '/' || c == '-')) {
-            return -1; // Invalid name
-        }
+    return hash;
+}
+
+// Helper function to add an instruction storing bytes of the new file
+static void delta_put_insert(struct byte_buffer *out, const unsigned char *data,
+                                                      size_t len) {
+    if(len == 0) {
+        return;
     }
-    struct helper *h = (struct helper *)helper;
-    // Check if name already exists
-    for(size_t i = 0; i < h->n_branches; i++) {
-        if(strcmp(h->branches[i]->branch_name, branch_name) == 0) {
-            return -2; // Name already exists
+    unsigned char op = 0;
+    buffer_put(out, &op, 1);
+    buffer_put_varint(out, len);
+    buffer_put(out, data, len);
+}
+
+// Helper function to add an instruction copying bytes from the base
+static void delta_put_copy(struct byte_buffer *out, size_t offset, size_t len) {
+    unsigned char op = 1;
+    buffer_put(out, &op, 1);
+    buffer_put_varint(out, offset);
+    buffer_put_varint(out, len);
+}
+
+// Helper function to write out a delta object. Its instructions are
+// compressed if that makes them smaller
+static int write_delta(struct helper *helper, uint64_t digest,
+                       struct delta_header *header, struct byte_buffer *ops) {
+    const unsigned char *body = ops->data;
+    size_t body_len = ops->len;
+    unsigned char *packed = NULL;
+#ifdef SVC_USE_ZSTD
+    if(helper->compress_level > 0 && ops->len > 0) {
+        size_t bound = ZSTD_compressBound(ops->len);
+        packed = malloc(bound);
+        if(packed == NULL) {
+            exit(1); // An error has occurred
+        }
+        size_t n = ZSTD_compress(packed, bound, ops->data, ops->len,
+                                 helper->compress_level);
+        if(!ZSTD_isError(n) && n < ops->len) {
+            header->flags |= DELTA_COMPRESSED;
+            body = packed;
+            body_len = n;
         }
     }
-    // Check for changes to be committed
-    if(check_changes(helper)) {
-        return -3; // There are uncommitted changes
+#endif
+    struct byte_buffer b = {NULL, 0, 0};
+    buffer_put(&b, DELTA_MAGIC, 4);
+    buffer_put_u32(&b, header->flags);
+    buffer_put_u32(&b, header->mode);
+    buffer_put_u64(&b, header->base);
+    buffer_put_u64(&b, header->size);
+    buffer_put_u64(&b, header->ops_len);
+    buffer_put(&b, body, body_len);
+    free(packed);
+
+    // Write it next to where it belongs and move it into place once whole
+    int ret = -1;
+    char *path = delta_path(helper, digest);
+    char *temp = NULL;
+    int fd = path == NULL ? -1 : open_temp(path, 0644, &temp);
+    if(fd != -1) {
+        ret = finish_temp(fd, temp, path, write_all(fd, b.data, b.len));
     }
+    free(path);
+    free(b.data);
+    return ret;
+}
 
-    // Create the new branch
-    struct branch *new_branch = malloc(sizeof(struct branch));
-    if(new_branch == NULL) {
-        return -1; // An error has occurred
+// Helper function to read a delta object. Returns its instructions, which
+// must be freed, or NULL if it is not stored or is corrupt
+static unsigned char *read_delta(struct helper *helper, uint64_t digest,
+                                           struct delta_header *header) {
+    char *path = delta_path(helper, digest);
+    if(path == NULL) {
+        return NULL; // An error has occurred
     }
-    // Copy the branch name
-    char *name = malloc(sizeof(char) * (strlen(branch_name) + 1));
-    if(name == NULL) {
-        return -1; // An error has occurred
+    struct file_map map;
+    int found = map_file(path, &map, NULL, MADV_SEQUENTIAL) == 0;
+    free(path);
+    if(!found) {
+        return NULL; // Not stored
     }
-    strcpy(name, branch_name);
-    new_branch->branch_name = name;
-    // Set the head of the new branch to the current branch's head
-    new_branch->head = h->current_branch->head;
-    // Create space for the tracked files
-    struct tracked_file *files = malloc(sizeof(struct tracked_file)
-                                        * h->current_branch->n_files);
-    if(files == NULL) {
-        return -1; // An error has occurred
+    struct byte_reader r = {map.data, map.len, 0};
+    reader_delta_header(&r, header);
+    // Instructions are at most half the size of the file they rebuild
+    if(r.error || header->ops_len > header->size / 2 + 1) {
+        unmap_file(&map);
+        return NULL; // Corrupt object
     }
-    new_branch->files = files;
-    // Copy the tracked files from current branch
-    for(size_t i = 0; i < h->current_branch->n_files; i++) {
-        // Copy filename of each
-        char *f_name = malloc(sizeof(char) *
-                       (strlen(h->current_branch->files[i].file_name) + 1));
-        if(f_name == NULL) {
-            return -1; // An error has occurred
+    unsigned char *ops = malloc(header->ops_len + 1);
+    if(ops == NULL) {
+        exit(1); // An error has occurred
+    }
+    int ok = 0;
+    if(!(header->flags & DELTA_COMPRESSED)) {
+        ok = r.left == header->ops_len;
+        if(ok) {
+            memcpy(ops, r.p, r.left);
         }
-        new_branch->files[i].file_name = f_name;
-        strcpy(new_branch->files[i].file_name,
-               h->current_branch->files[i].file_name);
-        // Copy the hash
-        new_branch->files[i].hash = h->current_branch->files[i].hash;
-        // Copy the change
-        new_branch->files[i].change = h->current_branch->files[i].change;
+    } else {
+#ifdef SVC_USE_ZSTD
+        size_t n = ZSTD_decompress(ops, header->ops_len, r.p, r.left);
+        ok = !ZSTD_isError(n) && n == header->ops_len;
+#endif
+        // Otherwise it cannot be read without zstd
     }
-    // Set number of files being tracked
-    new_branch->n_files = h->current_branch->n_files;
-
-    // Create space for the new branch
-    struct branch **branches = realloc(h->branches,
-                                sizeof(struct branch*) * (h->n_branches + 1));
-    if(branches == NULL) {
-        return -1; // An error has occurred
+    unmap_file(&map);
+    if(!ok) {
+        free(ops);
+        return NULL; // Corrupt object
     }
-    h->branches = branches;
-    // Put the new branch into the list of branches
-    h->branches[h->n_branches] = new_branch;
-    h->n_branches++;
-    return 0;
+    return ops;
 }
 
-int svc_checkout(void *helper, char *branch_name) {
-    if(branch_name == NULL) {
-        return -1; // An error has occurred
+// Helper function to read just the start of the delta object at path
+static int read_delta_header(char *path, struct delta_header *header) {
+    int fd = open(path, O_RDONLY);
+    if(fd == -1) {
+        return -1; // Not stored
     }
-    struct helper *h = (struct helper*)helper;
-    // Look for the branch
-    struct branch* branch = NULL;
-    for(size_t i = 0; i < h->n_branches; i++) {
-        if(strcmp(h->branches[i]->branch_name, branch_name) == 0) {
-            branch = h->branches[i];
-            break;
+    unsigned char data[36];
+    size_t done = 0;
+    while(done < sizeof(data)) {
+        ssize_t n = read(fd, data + done, sizeof(data) - done);
+        if(n == -1 && errno == EINTR) {
+            continue; // Interrupted, try again
         }
+        if(n <= 0) {
+            break; // Too short, or an error
+        }
+        done += n;
     }
-    if(branch == NULL) {
-        return -1; // Branch does not exist
-    }
-    if(check_changes(helper)) {
-        return -2; // uncommitted changes
+    close(fd);
+    struct byte_reader r = {data, done, 0};
+    reader_delta_header(&r, header);
+    return r.error ? -1 : 0;
+}
+
+// Helper function to take the fields written by write_delta from the start
+// of a delta object, flagging an error if they are not there
+static void reader_delta_header(struct byte_reader *r,
+                                struct delta_header *header) {
+    char magic[4];
+    reader_bytes(r, magic, 4);
+    header->flags = reader_u32(r);
+    header->mode = reader_u32(r);
+    header->base = reader_u64(r);
+    header->size = reader_u64(r);
+    header->ops_len = reader_u64(r);
+    if(memcmp(magic, DELTA_MAGIC, 4) != 0) {
+        r->error = 1; // Not a delta
     }
-    h->current_branch = branch;
-    // Set the workspace to the last commit of the branch
-    set_to_commit(helper, branch, branch->head);
-    return 0;
 }
 
-char **list_branches(void *helper, int *n_branches) {
-    if(n_branches == NULL) {
-        return NULL; // An error has occurred
+// Helper function to rebuild the contents with the given digest from its
+// delta, streaming them straight into dest
+static int restore_delta(struct helper *helper, uint64_t digest, char *dest) {
+    struct delta_header header;
+    unsigned char *ops = read_delta(helper, digest, &header);
+    if(ops == NULL) {
+        return -1; // Not stored, or corrupt
     }
-    struct helper *h = (struct helper*)helper;
-    *n_branches = h->n_branches;
-    // Create an array to store the branch names
-    char **arr = malloc(sizeof(char *)*h->n_branches);
-    if(arr == NULL) {
-        return NULL; // An error has occurred
+    // Copies come from all over the base
+    char *base_path = blob_path(helper, header.base);
+    struct file_map base;
+    if(base_path == NULL ||
+       map_file(base_path, &base, NULL, MADV_WILLNEED) != 0) {
+        free(base_path);
+        free(ops);
+        return -1; // The base is missing
     }
-    // Print out each name and copy into the array
-    for(size_t i = 0; i < h->n_branches; i++) {
-        printf("%s\n", h->branches[i]->branch_name);
-        arr[i] = h->branches[i]->branch_name;
+    free(base_path);
+    char *temp = NULL;
+    int fd = open_temp(dest, header.mode, &temp);
+    if(fd == -1) {
+        unmap_file(&base);
+        free(ops);
+        return -1; // An error has occurred
     }
-    return arr;
+    struct digest_state state;
+    digest_init(&state);
+    struct delta_writer w = {fd, malloc(HASH_BLOCK_SIZE), 0, 0, &state, 0};
+    if(w.buff == NULL) {
+        exit(1); // An error has occurred
+    }
+    int ret = apply_delta(&w, base.data, base.len, ops, header.ops_len);
+    delta_flush(&w);
+    // Only keep the file if it is exactly what was stored
+    if(w.error || w.total != header.size ||
+       digest_final(&state) != digest) {
+        ret = -1;
+    }
+    free(w.buff);
+    free(ops);
+    unmap_file(&base);
+    return finish_temp(fd, temp, dest, ret);
 }
 
-int svc_add(void *helper, char *file_name) {
-    if(file_name == NULL) {
-        return -1;
-    }
-    struct helper *h = (struct helper *)helper;
-    struct branch *branch = h->current_branch;
-    // Check if file is already being tracked
-    for(size_t i = 0; i < branch->n_files; i++) {
-        if(strcmp(branch->files[i].file_name, file_name) == 0) {
-            // If marked for deletion then set to addition
-            if(branch->files[i].change == 'D') {
-                branch->files[i].change = 'A';
-                branch->files[i].hash = hash_file(helper,
-                                        branch->files[i].file_name);
-                return branch->files[i].hash;
-            } else {
-                return -2; // Otherwise cannot add again
+// Helper function to follow a delta's instructions, copying bytes from the
+// base and the instructions into w
+static int apply_delta(struct delta_writer *w, const unsigned char *base,
+                       size_t base_len, const unsigned char *ops,
+                       size_t ops_len) {
+    struct byte_reader r = {ops, ops_len, 0};
+    while(r.left > 0 && !w->error) {
+        unsigned char op;
+        reader_bytes(&r, &op, 1);
+        if(op == 0) {
+            // Bytes stored in the delta
+            uint64_t len = reader_varint(&r);
+            if(r.error || len > r.left) {
+                return -1; // Corrupt object
+            }
+            delta_write(w, r.p, len);
+            r.p += len;
+            r.left -= len;
+        } else if(op == 1) {
+            // Bytes copied from the base
+            uint64_t offset = reader_varint(&r);
+            uint64_t len = reader_varint(&r);
+            if(r.error || offset > (uint64_t)base_len ||
+               len > (uint64_t)base_len - offset) {
+                return -1; // Corrupt object
             }
+            delta_write(w, base + offset, len);
+        } else {
+            return -1; // Corrupt object
         }
     }
-    // Check if file exists
-    if(access(file_name, F_OK) == -1) {
-        return -3; // Cannot access == file does not exist
+    return w->error ? -1 : 0;
+}
+
+// Helper function to add bytes to a rebuilt file
+static void delta_write(struct delta_writer *w, const unsigned char *data,
+                                                size_t len) {
+    while(len > 0 && !w->error) {
+        if(w->len == HASH_BLOCK_SIZE) {
+            delta_flush(w);
+        }
+        size_t n = HASH_BLOCK_SIZE - w->len;
+        if(n > len) {
+            n = len;
+        }
+        memcpy(w->buff + w->len, data, n);
+        w->len += n;
+        data += n;
+        len -= n;
     }
-    // Add file to list
-    struct tracked_file *temp = realloc(branch->files,
-                        sizeof(struct tracked_file) * (branch->n_files + 1));
-    if(temp == NULL) {
-        return -1; // An error has occurred
+}
+
+// Helper function to write out the buffered bytes of a rebuilt file
+static void delta_flush(struct delta_writer *w) {
+    if(w->len == 0 || w->error) {
+        return;
     }
-    branch->files = temp;
-    // Copy the file name
-    char *temp_str = malloc(sizeof(char) * (strlen(file_name) + 1));
-    if(temp_str == NULL) {
-        return -1; // An error has occurred
+    digest_update(w->state, w->buff, w->len);
+    if(write_all(w->fd, w->buff, w->len) != 0) {
+        w->error = 1;
     }
-    branch->files[branch->n_files].file_name = temp_str;
-    strcpy(branch->files[branch->n_files].file_name, file_name);
-    // Set the change to add
-    branch->files[branch->n_files].change = 'A';
-    // Set hash
-    branch->files[branch->n_files].hash = hash_file(helper, file_name);
-    // Increment number of files
-    branch->n_files++;
-    return branch->files[branch->n_files - 1].hash;
+    w->total += w->len;
+    w->len = 0;
 }
 
-int svc_rm(void *helper, char *file_name) {
-    if(file_name == NULL) {
-        return -1; // An error has occurred
+// Helper function to get a whole stored object's contents, mapping it if it
+// is large enough and reading it into memory otherwise. Objects are never
+// changed once written, so the mapping cannot be cut short under it. advice
+// is passed to madvise, for how the contents will be gone through. If st
+// is given, it is set to the file's status. Returns 0, or -1 if it cannot
+// be read
+static int map_file(char *path, struct file_map *map, struct stat *st,
+                    int advice) {
+    int fd = open(path, O_RDONLY);
+    if(fd == -1) {
+        return -1; // Cannot open the file
     }
-    struct helper *h = (struct helper *)helper;
-    struct branch *branch = h->current_branch;
-    // Check if file is already being tracked
-    int found = 0;
-    size_t index = 0;
-    for(size_t i = 0; i < branch->n_files; i++) {
-        // If it is not already being deleted and it matches the name
-        if(branch->files[i].change != 'D'
-        && strcmp(branch->files[i].file_name, file_name) == 0) {
-            found = 1; // Found the file
-            index = i;
-            break;
-        }
+    struct stat own;
+    if(st == NULL) {
+        st = &own;
     }
-    if(!found) {
-        return -2; // File not currently being tracked
+    if(fstat(fd, st) != 0) {
+        close(fd);
+        return -1; // An error has occurred
     }
-    // Set file to be deleted
-    branch->files[index].change = 'D';
-    return branch->files[index].hash;
+    // Map it, or fall back to reading it if it is small or cannot be mapped
+    int ret = map_fd(fd, st->st_size, map, advice) == 0 ? 0 :
+              read_fd(fd, st->st_size, map);
+    close(fd); // A mapping stays valid
+    return ret;
 }
 
-int svc_reset(void *helper, char *commit_id) {
-    if(commit_id == NULL) {
-        return -1; // An error has occurred
+// Helper function to map the first len bytes of an open stored object, so
+// they are read straight from the page cache rather than copied. Small
+// files are left to be read. Returns 0, or -1 if it is not mapped
+static int map_fd(int fd, size_t len, struct file_map *map, int advice) {
+    if(len < MAP_MIN_SIZE) {
+        return -1; // Cheaper to read
     }
-    struct helper *h = (struct helper *)helper;
-    // Check if commit exists
-    struct commit *commit = NULL;
-    for(size_t i = 0; i < h->n_commits; i++) {
-        if(strcmp(h->commits[i]->id, commit_id) == 0) {
-            commit = h->commits[i];
-            break;
-        }
+    void *data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(data == MAP_FAILED) {
+        return -1; // Not a file that can be mapped
     }
-    if(commit == NULL) {
-        return -2; // No commit with given id exists
+    madvise(data, len, advice);
+#ifdef MADV_HUGEPAGE
+    // Fewer page table entries for large files, where the kernel allows
+    if(len >= MAP_HUGE_SIZE) {
+        madvise(data, len, MADV_HUGEPAGE);
     }
-    // Set the workspace to the given commit
-    set_to_commit(h, h->current_branch, commit);
+#endif
+    map->data = data;
+    map->len = len;
+    map->mapped = 1;
     return 0;
 }
 
-char *svc_merge(void *helper, char *branch_name, struct resolution *resolutions, int n_resolutions) {
-    // Defensive checks
-    if(branch_name == NULL) {
-        puts("Invalid branch name");
-        return NULL;
-    }
-    struct helper *h = (struct helper *)helper;
-    struct branch *merge_branch = NULL;
-    // Find the merging branch
-    for(size_t i = 0; i < h->n_branches; i++) {
-        if(strcmp(h->branches[i]->branch_name, branch_name) == 0) {
-            merge_branch = h->branches[i]; // Found the branch
-            break;
-        }
-    }
-    if(merge_branch == NULL) {
-        puts("Branch not found");
-        return NULL;
-    }
-    // If branches have the same name, they are the same (names are unique)
-    if(strcmp(h->current_branch->branch_name, merge_branch->branch_name) == 0) {
-        puts("Cannot merge a branch with itself");
-        return NULL;
+// Helper function to read a whole workspace file into memory. It is never
+// mapped, as the user may cut it short while it is being read, and reading
+// a mapping past the file's new end raises SIGBUS. If st is given, it is
+// set to the file's status. Returns 0, or -1 if it cannot be read or is
+// larger than max bytes
+static int read_file(char *path, struct file_map *map, struct stat *st,
+                     size_t max) {
+    int fd = open(path, O_RDONLY);
+    if(fd == -1) {
+        return -1; // Cannot open the file
     }
-    if(check_changes(h)) {
-        puts("Changes must be committed");
-        return NULL;
+    struct stat own;
+    if(st == NULL) {
+        st = &own;
     }
+    int ret = fstat(fd, st) == 0 && (size_t)st->st_size <= max ?
+              read_fd(fd, st->st_size, map) : -1;
+    close(fd);
+    return ret;
+}
 
-    struct branch *branch = h->current_branch;
-    // Merge tracked files list
-    // Find the new size by checking how many unique file names there are
-    size_t count = 0;
-    char **temp_arr = malloc(sizeof(char *) *(branch->n_files +
-                            merge_branch->n_files + n_resolutions));
-    if(temp_arr == NULL) {
-        return NULL; // An error has occurred;
+// Helper function to read the first len bytes of an open file into memory.
+// Returns 0, or -1 if the file is now shorter or cannot be read
+static int read_fd(int fd, size_t len, struct file_map *map) {
+    map->mapped = 0;
+    map->data = malloc(len + 1);
+    if(map->data == NULL) {
+        return -1; // Too large to hold in memory
     }
-    for(size_t i = 0; i < branch->n_files; i++) {
-        temp_arr[i] = branch->files[i].file_name;
-        count++;
-    }
-    int conflict = 0;
-    for(size_t i = 0; i < merge_branch->n_files; i++) {
-        conflict = 0;
-        for(size_t j = 0; j < branch->n_files; j++) {
-            if(strcmp(temp_arr[j], merge_branch->files[i].file_name) == 0) {
-                conflict = 1;
-                break;
-            }
+    size_t done = 0;
+    while(done < len) {
+        ssize_t n = read(fd, map->data + done, len - done);
+        if(n == -1 && errno == EINTR) {
+            continue; // Interrupted, try again
         }
-        // If the file does not conflict, then add it to thew new list
-        if(!conflict) {
-            temp_arr[count] = merge_branch->files[i].file_name;
-            count++;
+        if(n <= 0) {
+            break; // The file is shorter than it was, or an error
         }
+        done += n;
     }
-    free(temp_arr);
-    // Resize the current branch to hold all the new files
-    size_t new_size = count;
-    struct tracked_file *temp = realloc(branch->files,
-                                sizeof(struct tracked_file) * new_size);
-    if(temp == NULL) {
-        return NULL; // An error has occurred
-    }
-    branch->files = temp;
-    // Set all the files being copied over to null initially
-    for(size_t i = branch->n_files; i < new_size; i++) {
-        branch->files[i].file_name = NULL;
+    if(done != len) {
+        free(map->data);
+        map->data = NULL;
+        return -1; // An error has occurred
     }
-    // Copy the merging branch files except those that already exist
-    int index = 0;
-    for(size_t i = 0; i < merge_branch->n_files; i++) {
-        char *fname = merge_branch->files[i].file_name;
-        int exist = 0;
-        // Check already exists
-        for(size_t j = 0; j < branch->n_files; j++) {
-            if(strcmp(fname, branch->files[j].file_name) == 0) {
-                exist = 1;
-                break;
-            }
-        }
-        if(!exist) {
-            // If does not exist, add to the new tracked files list
-            char *temp_str = malloc(sizeof(char)*
-                             (strlen(merge_branch->files[i].file_name) + 1));
-            branch->files[index + branch->n_files].file_name = temp_str;
-            strcpy(branch->files[index + branch->n_files].file_name,
-                    merge_branch->files[i].file_name);
-            // All changes are addition
-            branch->files[index + branch->n_files].change = 'A';
-            branch->files[index + branch->n_files].hash =
-                merge_branch->files[i].hash;
-            index++;
-            // Copy the file from last commit it was copied
-            struct commit *c = merge_branch->head;
-            int found = 0;
-            while(c != NULL && !found) {
-                // Look for the last commit containing the file
-                for(size_t k = 0; k < c->n_files; k++) {
-                    // If the file has the same name and it was changed
-                    if(strcmp(c->files[k].file_name,
-                       merge_branch->files[i].file_name) == 0
-                    && c->files[k].change != 'N') {
-                        // Found the file
-                        found = 1;
-                        // Create string for the shell command to copy it
-                        char *arr[] = {"cp ", h->dir, "/", c->id, "/\"",
-                                       merge_branch->files[i].file_name,"\" \"",
-                                       merge_branch->files[i].file_name, "\""};
-                        char *command = str_concat(arr, 9);
-                        if(command == NULL) {
-                            return NULL; // An error has occurred
-                        }
-                        // Execute command
-                        if(system(command) != 0) {
-                            return NULL; // An error has occurred
-                        }
-                        free(command);
-                        break;
-                    }
-                }
-                // Otherwise set to next parent
-                if(c->n_parents == 0) {
-                    c = NULL;
-                } else {
-                    c = c->parents[0];
-                }
-            }
+    map->len = done;
+    return 0;
+}
 
-        }
-    }
-    // Set up an array to track files to be removed
-    int *r_list = malloc(sizeof(int) * new_size);
-    int r_count = 0;
-    for(size_t i = 0; i < new_size; i++) {
-        r_list[i] = 0;
+// Helper function to release contents from map_file or read_file
+static void unmap_file(struct file_map *map) {
+    if(map->mapped) {
+        munmap(map->data, map->len);
+    } else {
+        free(map->data);
     }
-    // Resolve conflicting files
-    for(int j = 0; j < n_resolutions; j++) {
-        for(size_t i = 0; i < new_size; i++) {
-            char *fname = branch->files[i].file_name;
-            // If the file was conflicting
-            if(strcmp(fname, resolutions[j].file_name) == 0) {
-                // If file has a resolution file
-                if(resolutions[j].resolved_file != NULL) {
-                    // Replace conflicting file with resolution file
-                    char *t_arr[] = {"cp \"", resolutions[j].resolved_file,
-                                                      "\" \"", fname, "\""};
-                    char *command = str_concat(t_arr, 5);
-                    if(command == NULL) {
-                        return NULL; // An error has occurred
-                    }
-                    if(system(command) != 0) {
-                        return NULL; // An error has occurred
-                    }
-                    free(command);
-                    // Check if the conflicting file existed in current branch
-                    if(i < branch->n_files) {
-                        // If it did, then change was modification
-                        branch->files[i].change = 'M';
-                    } else {
-                        // Otherwise change was addition;
-                        branch->files[i].change = 'A';
-                    }
+    map->data = NULL;
+}
 
-                } else {
-                    // The resolution does not contain a file
-                    // If the conflicting file was not being tracked in the...
-                    // ... current branch,
-                    if(i >= branch->n_files) {
-                        r_list[i] = 1; // Mark for removal from track list
-                        r_count++;
-                    } else {
-                        // Otherwise mark the file as deletion
-                        branch->files[i].change = 'D';
-                    }
-                }
-                break;
-            }
-        }
+void *get_commit(void *helper, char *commit_id) {
+    if(helper == NULL || commit_id == NULL) {
+        return NULL; // Defensive checks
     }
-    branch->n_files = new_size;
-    // Remove the files that were marked for removal
-    remove_tracked_files(branch, r_list, r_count);
-    free(r_list);
-    // Create the commit message
-    char *arr[] = {"Merged branch ", branch_name};
-    char *message = str_concat(arr, 2);
-    if(message == NULL) {
-        return NULL; // An error has occurred
+    struct helper *h = (struct helper*)helper;
+    if(h->commit_index == NULL) {
+        return NULL; // No commits yet
     }
-    // Commit the changes
-    char *id = svc_commit(helper, message);
-    free(message);
-    struct commit *commit = (struct commit *)get_commit(helper, id);
-    // Update commit parents to include merging branch
-    struct commit **temp_parents = realloc(commit->parents,
-                                    sizeof(struct commit *)*2);
-    if(temp_parents == NULL) {
-        return NULL; // An error has occurred
+    // Look for the commit. Commits sharing an id are found in the order
+    // they were made, so the oldest is returned
+    size_t mask = h->commit_index_size - 1;
+    for(size_t i = string_hash(commit_id) & mask;
+        h->commit_index[i] != NULL; i = (i + 1) & mask) {
+        if(strcmp(h->commit_index[i]->id, commit_id) == 0) {
+            // Found the commit
+            return h->commit_index[i];
+        }
     }
-    commit->parents = temp_parents;
-    commit->parents[1] = merge_branch->head;
-    commit->n_parents = 2;
-    puts("Merge successful");
-    return id;
+    // Otherwise, not found
+    return NULL;
 }
 
-// Helper function to separate calculating the commit id from commit function
-void set_commit_id(struct commit* commit) {
-    if(commit == NULL) {
-        return; // Defensive checking
+// Find every commit with the given id, since set_commit_id can give two
+// different commits the same id. Returns NULL if there are none
+struct commit **get_commits_by_id(void *helper, char *commit_id,
+                                                 int *n_found) {
+    if(helper == NULL || commit_id == NULL || n_found == NULL) {
+        return NULL; // Defensive checks
     }
-    // The algorithm
-    int id = 0;
-    // Looping for the commit message
-    for(size_t i = 0; i < strlen(commit->message); i++) {
-        id += (unsigned char) commit->message[i];
+    struct helper *h = (struct helper*)helper;
+    *n_found = 0;
+    if(h->commit_index == NULL) {
+        return NULL; // No commits yet
     }
-    id %= 1000; // Same as doing modulus every loop
-    // Sort the array of files
-    qsort(commit->files, commit->n_files, sizeof(struct tracked_file), compar);
-    // Looping for changes in the commit
-    for(size_t i = 0; i < commit->n_files; i++) {
-        char c = commit->files[i].change;
-        if(c == 'A') {
-            id += 376591; // Change is addition
-        } else if (c == 'D') {
-            id += 85973; // Change is deletion
-        } else if (c == 'M') {
-            id += 9573681; // Change is modification
-        }
-        if(c != 'N') {
-            // Loop through file name if change is not NONE
-            for(size_t j = 0; j < strlen(commit->files[i].file_name); j++) {
-                unsigned char k = (unsigned char) commit->files[i].file_name[j];
-                id = ((id * (k % 37)) % 15485863) + 1;
+    struct commit **arr = NULL;
+    size_t mask = h->commit_index_size - 1;
+    for(size_t i = string_hash(commit_id) & mask;
+        h->commit_index[i] != NULL; i = (i + 1) & mask) {
+        if(strcmp(h->commit_index[i]->id, commit_id) == 0) {
+            struct commit **temp = realloc(arr,
+                                   sizeof(struct commit *) * (*n_found + 1));
+            if(temp == NULL) {
+                free(arr);
+                *n_found = 0;
+                return NULL; // An error has occurred
             }
+            arr = temp;
+            arr[*n_found] = h->commit_index[i];
+            (*n_found)++;
         }
     }
-    // Put id as a hex in commit
-    sprintf(commit->id, "%06x", id);
+    return arr;
 }
 
-// Comparator for sorting strings alphabetically ignoring upper and lower case
-int compar(const void *a, const void *b) {
-    // Comparator for 2 tracked files
-    char *a_name = ((struct tracked_file *)a)->file_name;
-    char *b_name = ((struct tracked_file *)b)->file_name;
-    // Find the min length of the two string and set max to it
-    size_t max = 0;
-    if(strlen(a_name) < strlen(b_name)) {
-        max = strlen(a_name);
-    } else {
-        max = strlen(b_name);
-    }
-    // Only need to compare up to max (length of shorter string)
-    for(size_t i = 0; i < max; i++){
-        int a_char = a_name[i];
-        int b_char = b_name[i];
-        // Convert to lower case
-        if(a_char >= 65 && a_char <= 90) {
-            a_char += 32;
-        }
-        if(b_char >= 65 && b_char <= 90) {
-            b_char += 32;
-        }
-        // Compare each character
-        if(a_char < b_char) {
-            return -1;
+// Helper function to add a commit to the id index, growing it if needed
+static void commit_index_insert(struct helper *helper, struct commit *commit) {
+    // Keep the index at most half full so probe sequences stay short
+    if(helper->n_commits * 2 > helper->commit_index_size) {
+        size_t new_size = helper->commit_index_size == 0 ?
+                          64 : helper->commit_index_size * 2;
+        struct commit **index = calloc(new_size, sizeof(struct commit *));
+        if(index == NULL) {
+            exit(1); // An error has occurred
         }
-        if(a_char > b_char) {
-            return 1;
+        free(helper->commit_index);
+        helper->commit_index = index;
+        helper->commit_index_size = new_size;
+        // Reinsert every commit in the order they were made
+        for(size_t i = 0; i < helper->n_commits; i++) {
+            if(helper->commits[i] != commit && !helper->commits[i]->pruned) {
+                commit_index_place(helper, helper->commits[i]);
+            }
         }
     }
-    // The strings are the same for the first (max) letters
-    if(max == strlen(a_name) && max == strlen(b_name)) {
-        return 0; // Strings are same length so they are equal
-    } else if (max == strlen(a_name)) {
-        return -1; // A is shorter so it comes first
-    } else {
-        return 1; // B is shorter
+    commit_index_place(helper, commit);
+}
+
+// Helper function to put a commit in the first free slot of its probe chain
+static void commit_index_place(struct helper *helper, struct commit *commit) {
+    size_t mask = helper->commit_index_size - 1;
+    size_t i = string_hash(commit->id) & mask;
+    while(helper->commit_index[i] != NULL) {
+        i = (i + 1) & mask;
     }
+    helper->commit_index[i] = commit;
 }
 
-// Helper function for removing files from a tracked_file list
-void remove_tracked_files(struct branch *branch, int *arr, int rem_count) {
-    if(rem_count == 0) {
-        return; // Nothing to remove
+// Helper function to make the id index again once commits have been pruned
+// from it
+static void commit_index_rebuild(struct helper *helper) {
+    if(helper->commit_index == NULL) {
+        return; // No commits yet
     }
-    int new_size = branch->n_files - rem_count;
-    // Case where every element gets removed
-    if(new_size == 0) {
-        for(size_t i = 0; i < branch->n_files; i++) {
-            free(branch->files[i].file_name);
+    memset(helper->commit_index, 0,
+           sizeof(struct commit *) * helper->commit_index_size);
+    for(size_t i = 0; i < helper->n_commits; i++) {
+        if(!helper->commits[i]->pruned) {
+            commit_index_place(helper, helper->commits[i]);
         }
-        free(branch->files);
-        branch->files = NULL;
-        branch->n_files = 0;
+    }
+}
+
+// Helper function to hash a string for the hash tables (FNV-1a)
+static size_t string_hash(char *str) {
+    size_t hash = 2166136261u;
+    for(size_t i = 0; str[i] != '\0'; i++) {
+        hash ^= (unsigned char)str[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+char **get_prev_commits(void *helper, void *commit, int *n_prev) {
+    if(n_prev == NULL || helper == NULL) {
+        return NULL; // An error has occurred
+    }
+    if(commit == NULL) {
+        *n_prev = 0;
+        return NULL;
+    }
+    struct commit *c = (struct commit *)commit;
+    if( c->n_parents == 0) {
+        *n_prev = 0;
+        return NULL;
+    }
+    *n_prev = c->n_parents;
+    // Create the array
+    char **arr = malloc(sizeof(char*)*c->n_parents);
+    if(arr == NULL) {
+        return NULL; // An error has occurred
+    }
+    // Copy a pointer to the parents id to the array
+    for(size_t i = 0; i < c->n_parents; i++) {
+        arr[i] = c->parents[i]->id;
+    }
+    return arr;
+}
+
+void print_commit(void *helper, char *commit_id) {
+    struct commit *commit = get_commit(helper, commit_id);
+    // Defensive checks
+    if(commit == NULL) {
+        puts("Invalid commit id");
         return;
     }
-    // Otherwise create a new list
-    struct tracked_file *temp = malloc(sizeof(struct tracked_file) * new_size);
-    if(temp == NULL) {
+    printf("%s [%s]: %s\n",
+            commit->id, commit->branch->branch_name, commit->message);
+    commit_read_files(helper, commit);
+    char c;
+    // Print the changes, which are kept sorted
+    for(size_t i = 0; i < commit->n_files; i++) {
+        c = commit->files[i].change;
+        // Substitute the change with the correct symbol
+        if(c != 'N') {
+            if(c == 'A') {
+                c = '+';
+            } else if (c == 'D') {
+                c = '-';
+            } else if (c == 'M') {
+                c = '/';
+            }
+            // If change was a modification
+            if(c == '/') {
+                // Find previous hash
+                int old_hash = 0;
+                struct tree_node *old = find_commit_file(helper,
+                                commit->parents[0], commit->files[i].path);
+                if(old != NULL) {
+                    old_hash = old->hash;
+                }
+                printf("    %c %s [%10d -> %10d]\n",
+                c, commit->files[i].path->name, old_hash, commit->files[i].hash);
+            } else {
+                printf("    %c %s\n", c, commit->files[i].path->name);
+            }
+        }
+    }
+    // Print the files being tracked and not removed
+    size_t count = 0;
+    struct tracked_file *files = commit_tracked_files(helper, commit, &count);
+    printf("\n    Tracked files (%d):\n", (int)count);
+    for(size_t i = 0; i < count; i++) {
+        printf("    [%10d] %s\n", files[i].hash, files[i].path->name);
+    }
+    free(files);
+}
+
+int svc_branch(void *helper, char *branch_name) {
+    if(branch_name == NULL) {
+        return -1;
+    }
+    // Check if branch name is valid
+    for(size_t i = 0; i < strlen(branch_name); i++) {
+        char c = branch_name[i];
+        // Using ascii codes to check valid characters
+        if(!((c >= 97 && c <= 122) || (c >= 65 && c <= 90) ||
+              (c >= 48 && c <= 57) || c == '_' || c == '/' || c == '-')) {
+            return -1; // Invalid name
+        }
+    }
+    struct helper *h = (struct helper *)helper;
+    // Check if name already exists
+    if(find_branch(h, branch_name) != NULL) {
+        return -2; // Name already exists
+    }
+    // Check for changes to be committed
+    if(check_changes(helper)) {
+        return -3; // There are uncommitted changes
+    }
+
+    // Create the new branch
+    struct branch *new_branch = malloc(sizeof(struct branch));
+    if(new_branch == NULL) {
+        return -1; // An error has occurred
+    }
+    // Copy the branch name
+    char *name = malloc(sizeof(char) * (strlen(branch_name) + 1));
+    if(name == NULL) {
+        return -1; // An error has occurred
+    }
+    strcpy(name, branch_name);
+    new_branch->branch_name = name;
+    // Create space for the tracked files
+    struct tracked_file *files = malloc(sizeof(struct tracked_file)
+                                        * h->current_branch->n_files);
+    if(files == NULL) {
+        return -1; // An error has occurred
+    }
+    new_branch->files = files;
+    // Copy the tracked files from current branch
+    for(size_t i = 0; i < h->current_branch->n_files; i++) {
+        // Share the path of each
+        new_branch->files[i].path = h->current_branch->files[i].path;
+        // Copy the hash
+        new_branch->files[i].hash = h->current_branch->files[i].hash;
+        new_branch->files[i].digest = h->current_branch->files[i].digest;
+        new_branch->files[i].cache = h->current_branch->files[i].cache;
+        // Copy the change
+        new_branch->files[i].change = h->current_branch->files[i].change;
+        new_branch->files[i].lazy = h->current_branch->files[i].lazy;
+    }
+    // Set number of files being tracked
+    new_branch->n_files = h->current_branch->n_files;
+    new_branch->files_cap = new_branch->n_files;
+    new_branch->file_index = NULL;
+    new_branch->file_index_size = 0;
+    new_branch->seq = h->n_branches;
+    new_branch->stage = 0;
+    // Set the head of the new branch to the current branch's head, sharing
+    // its bitmap
+    new_branch->head = NULL;
+    branch_set_head(h, new_branch, h->current_branch->head);
+    branch_index_rebuild(new_branch);
+    // Record the branch in the journal
+    if(journal_write_branch(h, new_branch) != 0) {
+        branch_set_head(h, new_branch, NULL);
+        free(new_branch->file_index);
+        free(files);
+        free(name);
+        free(new_branch);
+        return -1; // An error has occurred
+    }
+    // Put the new branch into the list of branches and the name indexes
+    branch_register(h, new_branch);
+    return 0;
+}
+
+int svc_checkout(void *helper, char *branch_name) {
+    if(branch_name == NULL) {
+        return -1; // An error has occurred
+    }
+    struct helper *h = (struct helper*)helper;
+    // Look for the branch
+    struct branch* branch = find_branch(h, branch_name);
+    if(branch == NULL) {
+        return -1; // Branch does not exist
+    }
+    if(check_changes(helper)) {
+        return -2; // uncommitted changes
+    }
+    // Record the switch first, so a failed write leaves everything as it was
+    struct branch *from = h->current_branch;
+    if(journal_write_current(h, branch) != 0) {
+        return -1; // An error has occurred
+    }
+    // Set the workspace, which holds the files of the branch being left, to
+    // the last commit of the branch
+    if(set_to_commit(helper, from, branch, branch->head) != 0) {
+        journal_write_current(h, from); // Take the switch back
+        return -1; // An error has occurred
+    }
+    h->current_branch = branch;
+    return 0;
+}
+
+char **list_branches(void *helper, int *n_branches) {
+    char **arr = svc_branch_names(helper, n_branches);
+    if(arr == NULL) {
+        return NULL; // An error has occurred
+    }
+    // Print out each name
+    for(int i = 0; i < *n_branches; i++) {
+        printf("%s\n", arr[i]);
+    }
+    return arr;
+}
+
+// Get the branch names in the order they were created without printing
+// them. The names belong to the repository, only the array must be freed
+char **svc_branch_names(void *helper, int *n_branches) {
+    if(helper == NULL || n_branches == NULL) {
+        return NULL; // An error has occurred
+    }
+    struct helper *h = (struct helper*)helper;
+    *n_branches = h->n_branches;
+    // Create an array to store the branch names
+    char **arr = malloc(sizeof(char *)*h->n_branches);
+    if(arr == NULL) {
+        return NULL; // An error has occurred
+    }
+    for(size_t i = 0; i < h->n_branches; i++) {
+        arr[i] = h->branches[i]->branch_name;
+    }
+    return arr;
+}
+
+// Get the names of the branches starting with prefix, such as "release/",
+// in strcmp order. An empty prefix lists every branch
+char **svc_branch_names_prefix(void *helper, char *prefix, int *n_branches) {
+    if(helper == NULL || prefix == NULL || n_branches == NULL) {
+        return NULL; // An error has occurred
+    }
+    struct helper *h = (struct helper*)helper;
+    size_t len = strlen(prefix);
+    // Names with the prefix are a contiguous run of the sorted list that
+    // starts at the first name not before the prefix
+    size_t start = sorted_branch_position(h, prefix);
+    size_t end = start;
+    while(end < h->n_branches &&
+          strncmp(h->sorted_branches[end]->branch_name, prefix, len) == 0) {
+        end++;
+    }
+    *n_branches = end - start;
+    char **arr = malloc(sizeof(char *) * (end - start + 1));
+    if(arr == NULL) {
+        return NULL; // An error has occurred
+    }
+    for(size_t i = start; i < end; i++) {
+        arr[i - start] = h->sorted_branches[i]->branch_name;
+    }
+    return arr;
+}
+
+// Helper function to find a branch by name, NULL if there is none
+static struct branch *find_branch(struct helper *h, char *name) {
+    if(h->branch_index == NULL) {
+        return NULL;
+    }
+    size_t mask = h->branch_index_size - 1;
+    for(size_t i = string_hash(name) & mask; h->branch_index[i] != NULL;
+                                                i = (i + 1) & mask) {
+        if(strcmp(h->branch_index[i]->branch_name, name) == 0) {
+            return h->branch_index[i];
+        }
+    }
+    return NULL;
+}
+
+// Helper function to add a branch to the list of branches, the name index
+// and the sorted list used for prefix listing
+static void branch_register(struct helper *h, struct branch *branch) {
+    struct branch **branches = realloc(h->branches,
+                               sizeof(struct branch *) * (h->n_branches + 1));
+    struct branch **sorted = realloc(h->sorted_branches,
+                             sizeof(struct branch *) * (h->n_branches + 1));
+    if(branches != NULL) {
+        h->branches = branches;
+    }
+    if(sorted != NULL) {
+        h->sorted_branches = sorted;
+    }
+    if(branches == NULL || sorted == NULL) {
+        exit(1); // An error has occurred
+    }
+    // Keep the sorted list in order with one binary search and a shift
+    size_t pos = sorted_branch_position(h, branch->branch_name);
+    memmove(&sorted[pos + 1], &sorted[pos],
+            sizeof(struct branch *) * (h->n_branches - pos));
+    sorted[pos] = branch;
+    branches[h->n_branches++] = branch;
+
+    // Keep the index at most half full so probe sequences stay short
+    if(h->n_branches * 2 > h->branch_index_size) {
+        size_t new_size = h->branch_index_size == 0 ?
+                          16 : h->branch_index_size * 2;
+        struct branch **index = calloc(new_size, sizeof(struct branch *));
+        if(index == NULL) {
+            exit(1); // An error has occurred
+        }
+        free(h->branch_index);
+        h->branch_index = index;
+        h->branch_index_size = new_size;
+        for(size_t i = 0; i + 1 < h->n_branches; i++) {
+            branch_index_place(h, h->branches[i]);
+        }
+    }
+    branch_index_place(h, branch);
+}
+
+// Helper function to put a branch in the first free slot of its probe chain
+static void branch_index_place(struct helper *h, struct branch *branch) {
+    size_t mask = h->branch_index_size - 1;
+    size_t i = string_hash(branch->branch_name) & mask;
+    while(h->branch_index[i] != NULL) {
+        i = (i + 1) & mask;
+    }
+    h->branch_index[i] = branch;
+}
+
+// Helper function to find the first position in the sorted branch list
+// whose name is not before name
+static size_t sorted_branch_position(struct helper *h, char *name) {
+    size_t lo = 0;
+    size_t hi = h->n_branches;
+    while(lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if(strcmp(h->sorted_branches[mid]->branch_name, name) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+int svc_add(void *helper, char *file_name) {
+    if(file_name == NULL) {
+        return -1;
+    }
+    struct helper *h = (struct helper *)helper;
+    struct branch *branch = h->current_branch;
+    // Files left out of the workspace cannot be added
+    if(!sparse_matches(h, file_name)) {
+        return -4;
+    }
+    // Check if file is already being tracked
+    long i = branch_find_file(h, branch, file_name);
+    if(i != -1) {
+        // If marked for deletion then set to addition
+        if(branch->files[i].change == 'D') {
+            branch->files[i].change = 'A';
+            // Files not yet hydrated still have their committed contents
+            if(!not_in_workspace(&branch->files[i])) {
+                hash_tracked_file(h, &branch->files[i]);
+            }
+            return branch->files[i].hash;
+        } else {
+            return -2; // Otherwise cannot add again
+        }
+    }
+    // Check if file exists
+    if(access(file_name, F_OK) == -1) {
+        return -3; // Cannot access == file does not exist
+    }
+    // Make room in the list for the file
+    if(branch_reserve(branch, branch->n_files + 1) != 0) {
+        return -1; // An error has occurred
+    }
+    // Store the file's path
+    branch->files[branch->n_files].path = intern_path(h, file_name,
+                                                      strlen(file_name));
+    // Set the change to add
+    branch->files[branch->n_files].change = 'A';
+    branch->files[branch->n_files].hash = 0;
+    branch->files[branch->n_files].digest = 0;
+    branch->files[branch->n_files].cache.inode = 0;
+    branch->files[branch->n_files].lazy = 0;
+    // Set hash
+    hash_tracked_file(h, &branch->files[branch->n_files]);
+    // Increment number of files
+    branch_index_add(branch, branch->n_files);
+    branch->n_files++;
+    return branch->files[branch->n_files - 1].hash;
+}
+
+// Stage many files at once. results[i] gets what svc_add would have returned
+// for file_names[i]. The tracked file list grows once for the whole batch
+// and the files are hashed in parallel. Returns how many files were staged
+int svc_add_many(void *helper, char **file_names, int n_files, int *results) {
+    if(helper == NULL || file_names == NULL || results == NULL || n_files < 0) {
+        return -1; // An error has occurred
+    }
+    struct helper *h = (struct helper *)helper;
+    struct branch *branch = h->current_branch;
+    // Make room for every file up front
+    if(branch_reserve(branch, branch->n_files + n_files) != 0) {
+        return -1; // An error has occurred
+    }
+    // Positions of the files that need hashing, -1 if nothing to hash
+    long *positions = malloc(sizeof(long) * (n_files + 1));
+    size_t *jobs = malloc(sizeof(size_t) * (n_files + 1));
+    if(positions == NULL || jobs == NULL) {
+        free(positions);
+        free(jobs);
+        return -1; // An error has occurred
+    }
+    size_t n_jobs = 0;
+    // Check each file in order, exactly as svc_add would
+    for(int i = 0; i < n_files; i++) {
+        positions[i] = -1;
+        char *file_name = file_names[i];
+        if(file_name == NULL) {
+            results[i] = -1;
+            continue;
+        }
+        if(!sparse_matches(h, file_name)) {
+            results[i] = -4; // Left out of the workspace
+            continue;
+        }
+        long found = branch_find_file(h, branch, file_name);
+        if(found != -1) {
+            // If marked for deletion then set to addition
+            if(branch->files[found].change == 'D') {
+                branch->files[found].change = 'A';
+                positions[i] = found;
+                // Files not yet hydrated still have their committed contents
+                if(!not_in_workspace(&branch->files[found])) {
+                    jobs[n_jobs++] = found;
+                }
+            } else {
+                results[i] = -2; // Otherwise cannot add again
+            }
+            continue;
+        }
+        // Check if file exists
+        if(access(file_name, F_OK) == -1) {
+            results[i] = -3; // Cannot access == file does not exist
+            continue;
+        }
+        // Store the file's path
+        struct tracked_file *file = &branch->files[branch->n_files];
+        file->path = intern_path(h, file_name, strlen(file_name));
+        file->change = 'A';
+        file->hash = 0;
+        file->digest = 0;
+        file->cache.inode = 0;
+        file->lazy = 0;
+        branch_index_add(branch, branch->n_files);
+        positions[i] = branch->n_files;
+        jobs[n_jobs++] = branch->n_files;
+        branch->n_files++;
+    }
+
+    // Hash every staged file in parallel
+    struct hash_job_args args = {h, branch->files, jobs, NULL, NULL};
+    parallel_for(h, n_jobs, hash_job, &args);
+
+    // Report the hashes
+    int added = 0;
+    for(int i = 0; i < n_files; i++) {
+        if(positions[i] != -1) {
+            results[i] = branch->files[positions[i]].hash;
+            added++;
+        }
+    }
+    free(positions);
+    free(jobs);
+    return added;
+}
+
+// Comparator for sorting paths so directories are added in a fixed order
+static int compar_path(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+// Stage every regular file under a directory. Returns how many files were
+// staged, or -1 if the directory could not be read
+int svc_add_dir(void *helper, char *dir_path) {
+    if(helper == NULL || dir_path == NULL) {
+        return -1; // An error has occurred
+    }
+    struct helper *h = (struct helper *)helper;
+    // Tracked paths never start with "./" or end in '/', so "./src/" is
+    // walked as "src" and "./" as "."
+    while(dir_path[0] == '.' && dir_path[1] == '/') {
+        dir_path += 2;
+        while(dir_path[0] == '/') {
+            dir_path++;
+        }
+    }
+    size_t len = strlen(dir_path);
+    while(len > 1 && dir_path[len - 1] == '/') {
+        len--;
+    }
+    char *dir = malloc(sizeof(char) * (len + 2));
+    if(dir == NULL) {
+        exit(1); // An error has occurred
+    }
+    if(len == 0) {
+        strcpy(dir, ".");
+    } else {
+        memcpy(dir, dir_path, len);
+        dir[len] = '\0';
+    }
+    // The repository is found by what it is rather than by name, since it
+    // can be reached through many different paths
+    struct stat repo;
+    if(lstat(h->dir, &repo) != 0) {
+        memset(&repo, 0, sizeof(repo));
+    }
+    struct file_list list = {NULL, 0, 0};
+    if(collect_files(h, dir, &repo, &list) != 0) {
+        free(dir);
+        free_file_list(&list);
+        return -1; // An error has occurred
+    }
+    free(dir);
+    // readdir order depends on the file system, so sort what was found
+    qsort(list.names, list.n, sizeof(char *), compar_path);
+    int ret = add_file_list(h, &list);
+    free_file_list(&list);
+    return ret;
+}
+
+// Stage every regular file matching a glob pattern. Returns how many files
+// were staged, or -1 if the pattern could not be expanded
+int svc_add_glob(void *helper, char *pattern) {
+    if(helper == NULL || pattern == NULL) {
+        return -1; // An error has occurred
+    }
+    glob_t g;
+    int ret = glob(pattern, GLOB_MARK, NULL, &g);
+    if(ret == GLOB_NOMATCH) {
+        return 0; // Nothing to add
+    }
+    if(ret != 0) {
+        return -1; // An error has occurred
+    }
+    struct file_list list = {NULL, 0, 0};
+    for(size_t i = 0; i < g.gl_pathc; i++) {
+        char *path = g.gl_pathv[i];
+        // GLOB_MARK puts a '/' on the end of directories
+        if(path[strlen(path) - 1] != '/' && file_list_push(&list, path) != 0) {
+            free_file_list(&list);
+            globfree(&g);
+            return -1; // An error has occurred
+        }
+    }
+    globfree(&g);
+    ret = add_file_list(helper, &list);
+    free_file_list(&list);
+    return ret;
+}
+
+// Mark many files for removal at once. results[i] gets what svc_rm would
+// have returned for file_names[i]. Returns how many files were marked
+int svc_rm_many(void *helper, char **file_names, int n_files, int *results) {
+    if(helper == NULL || file_names == NULL || results == NULL || n_files < 0) {
+        return -1; // An error has occurred
+    }
+    int removed = 0;
+    for(int i = 0; i < n_files; i++) {
+        results[i] = svc_rm(helper, file_names[i]);
+        if(results[i] >= 0) {
+            removed++;
+        }
+    }
+    return removed;
+}
+
+int svc_rm(void *helper, char *file_name) {
+    if(file_name == NULL) {
+        return -1; // An error has occurred
+    }
+    struct helper *h = (struct helper *)helper;
+    struct branch *branch = h->current_branch;
+    // Check if file is already being tracked
+    long index = branch_find_file(h, branch, file_name);
+    // It must also not already be being deleted
+    if(index == -1 || branch->files[index].change == 'D') {
+        return -2; // File not currently being tracked
+    }
+    // Set file to be deleted
+    branch->files[index].change = 'D';
+    return branch->files[index].hash;
+}
+
+int svc_reset(void *helper, char *commit_id) {
+    if(commit_id == NULL) {
+        return -1; // An error has occurred
+    }
+    struct helper *h = (struct helper *)helper;
+    // Check if commit exists
+    int n_found = 0;
+    struct commit **found = get_commits_by_id(h, commit_id, &n_found);
+    if(found == NULL) {
+        return -2; // No commit with given id exists
+    }
+    // If several commits share the id, prefer one made on this branch
+    struct commit *commit = found[0];
+    for(int i = 0; i < n_found; i++) {
+        if(found[i]->branch == h->current_branch) {
+            commit = found[i];
+            break;
+        }
+    }
+    free(found);
+    // Record where the branch now points first, so a failed write leaves
+    // everything as it was
+    struct branch *branch = h->current_branch;
+    struct commit *old = branch->head;
+    if(journal_write_head(h, branch, commit) != 0) {
+        return -1; // An error has occurred
+    }
+    // Set the workspace to the given commit
+    if(set_to_commit(h, branch, branch, commit) != 0) {
+        journal_write_head(h, branch, old); // Take the move back
+        return -1; // An error has occurred
+    }
+    return 0;
+}
+
+char *svc_merge(void *helper, char *branch_name, struct resolution *resolutions, int n_resolutions) {
+    // Defensive checks
+    if(branch_name == NULL) {
+        puts("Invalid branch name");
+        return NULL;
+    }
+    struct helper *h = (struct helper *)helper;
+    // Find the merging branch
+    struct branch *merge_branch = find_branch(h, branch_name);
+    if(merge_branch == NULL) {
+        puts("Branch not found");
+        return NULL;
+    }
+    // Names are unique, so the same name is the same branch
+    if(merge_branch == h->current_branch) {
+        puts("Cannot merge a branch with itself");
+        return NULL;
+    }
+    if(check_changes(h)) {
+        puts("Changes must be committed");
+        return NULL;
+    }
+
+    struct branch *branch = h->current_branch;
+    // Files as they were where the branches split, so that a path changed
+    // on only one side can be merged without a resolution
+    struct commit *base = merge_base(h, branch->head, merge_branch->head);
+    struct tree_node *base_tree = commit_tree(h, base);
+    // Merge tracked files list. Every path of the merging branch is looked
+    // up once in the current branch's index: paths it does not track are
+    // added, common paths keep the current branch's version unless only
+    // the merging branch changed them or a resolution says otherwise
+    size_t n_current = branch->n_files;
+    if(branch_reserve(branch, n_current + merge_branch->n_files) != 0) {
+        return NULL; // An error has occurred
+    }
+    // Keep this branch's files as they were, and every path written to the
+    // workspace, so that a merge that cannot be finished can be undone
+    size_t n_extra = n_resolutions > 0 ? (size_t)n_resolutions : 0;
+    struct tracked_file *saved = malloc(sizeof(struct tracked_file)
+                                        * (n_current + 1));
+    struct path **written = malloc(sizeof(struct path *)
+                                   * (merge_branch->n_files + n_extra + 1));
+    size_t *jobs = malloc(sizeof(size_t) * (merge_branch->n_files + 1));
+    int *results = malloc(sizeof(int) * (merge_branch->n_files + 1));
+    if(saved == NULL || written == NULL || jobs == NULL || results == NULL) {
+        free(saved);
+        free(written);
+        free(jobs);
+        free(results);
+        return NULL; // An error has occurred
+    }
+    memcpy(saved, branch->files, sizeof(struct tracked_file) * n_current);
+    size_t n_jobs = 0;
+    size_t index = n_current;
+    for(size_t i = 0; i < merge_branch->n_files; i++) {
+        struct tracked_file *theirs = &merge_branch->files[i];
+        struct path *path = theirs->path;
+        struct tree_node *original = tree_find(base_tree, path);
+        long found = branch_find_path(branch, path);
+        if(found != -1) {
+            struct tracked_file *ours = &branch->files[found];
+            // Take their version if only they changed the file
+            if(original != NULL && same_contents(ours->hash, ours->digest,
+                                   original->hash, original->digest)
+            && !same_contents(ours->hash, ours->digest,
+                              theirs->hash, theirs->digest)
+            && theirs->digest != 0) {
+                ours->change = 'M';
+                ours->hash = theirs->hash;
+                ours->digest = theirs->digest;
+                ours->cache.inode = 0;
+                if(h->lazy && !not_in_workspace(ours)) {
+                    // Leave their version to svc_hydrate, once the rest
+                    // are in place
+                    ours->lazy = 1;
+                } else if(!not_in_workspace(ours)) {
+                    jobs[n_jobs++] = found;
+                }
+            }
+            continue;
+        }
+        // Leave out files that were removed on this branch and not changed
+        // on the merging branch since
+        if(original != NULL && same_contents(theirs->hash, theirs->digest,
+                                      original->hash, original->digest)) {
+            continue;
+        }
+        // Otherwise add it to the new tracked files list
+        branch->files[index].path = path;
+        // All changes are addition
+        branch->files[index].change = 'A';
+        branch->files[index].hash = theirs->hash;
+        branch->files[index].digest = theirs->digest;
+        branch->files[index].cache.inode = 0;
+        branch->files[index].lazy = h->lazy && theirs->digest != 0;
+        branch_index_add(branch, index);
+        // Copy the file from the blob holding its contents, unless it is
+        // left out of the workspace
+        if(!not_in_workspace(&branch->files[index]) && theirs->digest != 0) {
+            jobs[n_jobs++] = index;
+        }
+        index++;
+    }
+    size_t new_size = index;
+    // Restore the added and updated files in parallel
+    restore_files(h, branch->files, jobs, n_jobs, results);
+    int failed = 0;
+    size_t n_written = 0;
+    for(size_t i = 0; i < n_jobs; i++) {
+        if(results[i] != 0) {
+            failed = 1;
+        } else {
+            written[n_written++] = branch->files[jobs[i]].path;
+        }
+    }
+    free(jobs);
+    free(results);
+    if(failed) {
+        merge_undo(h, branch, saved, n_current, written, n_written);
+        free(saved);
+        free(written);
+        return NULL; // An error has occurred
+    }
+    // Take away this branch's version of the files left to svc_hydrate
+    for(size_t i = 0; i < n_current; i++) {
+        if(branch->files[i].lazy && !saved[i].lazy
+           && !not_in_workspace(&saved[i])) {
+            unlink(branch->files[i].path->name);
+            written[n_written++] = branch->files[i].path;
+        }
+    }
+    // Files the merging branch removed, and this branch did not change since
+    for(size_t i = 0; base_tree != NULL && i < n_current; i++) {
+        struct tracked_file *ours = &branch->files[i];
+        struct tree_node *original = tree_find(base_tree, ours->path);
+        if(ours->change == 'N' && original != NULL
+        && branch_find_path(merge_branch, ours->path) == -1
+        && same_contents(ours->hash, ours->digest,
+                         original->hash, original->digest)) {
+            ours->change = 'D';
+        }
+    }
+    // Set up an array to track files to be removed
+    int *r_list = malloc(sizeof(int) * new_size);
+    int r_count = 0;
+    for(size_t i = 0; i < new_size; i++) {
+        r_list[i] = 0;
+    }
+    // Resolve conflicting files, finding each through the branch's index
+    for(int j = 0; j < n_resolutions; j++) {
+        // A name that was never tracked cannot be conflicting
+        struct path *path = find_path(h, resolutions[j].file_name);
+        long i = path == NULL ? -1 : branch_find_path(branch, path);
+        if(i == -1) {
+            continue;
+        }
+        // If file has a resolution file
+        if(resolutions[j].resolved_file != NULL) {
+            // Replace conflicting file with resolution file
+            if(copy_file(resolutions[j].resolved_file, path->name) != 0) {
+                merge_undo(h, branch, saved, n_current, written, n_written);
+                free(saved);
+                free(written);
+                free(r_list);
+                return NULL; // An error has occurred
+            }
+            written[n_written++] = path;
+            // The contents changed, so it must be hashed again
+            branch->files[i].cache.inode = 0;
+            branch->files[i].digest = 0;
+            branch->files[i].lazy = 0;
+            // Check if the conflicting file existed in current branch
+            if((size_t)i < n_current) {
+                // If it did, then change was modification
+                branch->files[i].change = 'M';
+            } else {
+                // Otherwise change was addition;
+                branch->files[i].change = 'A';
+            }
+        } else {
+            // The resolution does not contain a file
+            // If the conflicting file was not being tracked in the...
+            // ... current branch,
+            if((size_t)i >= n_current) {
+                // Mark for removal from track list
+                if(r_list[i] == 0) {
+                    r_list[i] = 1;
+                    r_count++;
+                }
+            } else {
+                // Otherwise mark the file as deletion
+                branch->files[i].change = 'D';
+            }
+        }
+    }
+    branch->n_files = new_size;
+    // Remove the files that were marked for removal
+    remove_tracked_files(branch, r_list, r_count);
+    free(r_list);
+    // Create the commit message
+    char *arr[] = {"Merged branch ", branch_name};
+    char *message = str_concat(arr, 2);
+    // Commit the changes, with the merging branch as the second parent
+    char *id = message == NULL ? NULL
+             : make_commit(h, message, merge_branch->head);
+    free(message);
+    if(id == NULL) {
+        merge_undo(h, branch, saved, n_current, written, n_written);
+        free(saved);
+        free(written);
+        return NULL; // Nothing was committed
+    }
+    free(saved);
+    free(written);
+    puts("Merge successful");
+    return id;
+}
+
+// Helper function to undo a merge that could not be finished. The branch
+// gets back the tracked files saved before it started, and each path
+// written to the workspace gets back this branch's version, or is removed
+// if this branch had none there
+static void merge_undo(struct helper *h, struct branch *branch,
+                       struct tracked_file *saved, size_t n_current,
+                       struct path **written, size_t n_written) {
+    memcpy(branch->files, saved, sizeof(struct tracked_file) * n_current);
+    branch->n_files = n_current;
+    branch_index_rebuild(branch);
+    for(size_t i = 0; i < n_written; i++) {
+        long pos = branch_find_path(branch, written[i]);
+        struct tracked_file *file = pos >= 0 ? &branch->files[pos] : NULL;
+        if(file == NULL || file->lazy || not_in_workspace(file)) {
+            unlink(written[i]->name);
+        } else if(file->digest == 0
+                  || restore_file(h, file, &file->cache) != 0) {
+            file->cache.inode = 0; // Left to be hashed again
+        }
+    }
+}
+
+// Helper function to check if two versions of a file have the same
+// contents. Digests are only compared when both are known
+static int same_contents(int hash_a, uint64_t digest_a, int hash_b,
+                         uint64_t digest_b) {
+    if(hash_a != hash_b) {
+        return 0;
+    }
+    return digest_a == 0 || digest_b == 0 || digest_a == digest_b;
+}
+
+// Helper function to find a commit's generation: one more than the highest
+// generation of its parents, so every ancestor of a commit has a lower one
+static size_t commit_generation(struct commit *commit) {
+    size_t generation = 0;
+    for(size_t i = 0; i < commit->n_parents; i++) {
+        if(commit->parents[i]->generation > generation) {
+            generation = commit->parents[i]->generation;
+        }
+    }
+    return generation + 1;
+}
+
+// Find a commit that both commits descend from and that no other such
+// commit descends from. Returns its id, or NULL if they share no history
+char *svc_merge_base(void *helper, char *commit_a, char *commit_b) {
+    if(helper == NULL || commit_a == NULL || commit_b == NULL) {
+        return NULL; // Defensive checks
+    }
+    struct commit *base = merge_base(helper, get_commit(helper, commit_a),
+                                             get_commit(helper, commit_b));
+    return base == NULL ? NULL : base->id;
+}
+
+// Helper function to find the lowest common ancestor of two commits.
+// Commits are visited from the highest generation down, marking which of
+// the two they were reached from. A commit's children all have higher
+// generations, so its marks are complete when it is visited, and the first
+// commit reached from both has no common ancestor below it
+static struct commit *merge_base(struct helper *helper, struct commit *a,
+                                                        struct commit *b) {
+    if(a == NULL || b == NULL) {
+        return NULL; // No history to share
+    }
+    // When one already contains the other there is nothing to search
+    if(commit_is_ancestor(helper, a, b)) {
+        return a;
+    }
+    if(commit_is_ancestor(helper, b, a)) {
+        return b;
+    }
+    unsigned char *marks = calloc(helper->n_commits, 1);
+    struct commit_heap heap = {NULL, 0, 0, 0};
+    if(marks == NULL) {
+        exit(1); // An error has occurred
+    }
+    marks[a->seq] |= 1;
+    marks[b->seq] |= 2;
+    commit_heap_push(&heap, a);
+    commit_heap_push(&heap, b);
+    struct commit *base = NULL;
+    while(heap.n > 0) {
+        struct commit *commit = commit_heap_pop(&heap);
+        unsigned char mark = marks[commit->seq];
+        if(mark == 3) {
+            base = commit;
+            break;
+        }
+        for(size_t i = 0; i < commit->n_parents; i++) {
+            struct commit *parent = commit->parents[i];
+            // Only visit a parent again if it gained a mark
+            if((marks[parent->seq] | mark) != marks[parent->seq]) {
+                marks[parent->seq] |= mark;
+                commit_heap_push(&heap, parent);
+            }
+        }
+    }
+    free(heap.commits);
+    free(marks);
+    return base;
+}
+
+// Check if a commit is an ancestor of another, or the same commit. Returns
+// 1 if it is, 0 if not and -1 if either commit does not exist
+int svc_is_ancestor(void *helper, char *ancestor, char *descendant) {
+    if(helper == NULL || ancestor == NULL || descendant == NULL) {
+        return -1; // Defensive checks
+    }
+    struct commit *a = get_commit(helper, ancestor);
+    struct commit *b = get_commit(helper, descendant);
+    if(a == NULL || b == NULL) {
+        return -1; // No such commit
+    }
+    return commit_is_ancestor(helper, a, b);
+}
+
+// Helper function to check if a is b or one of its ancestors. Only commits
+// with a higher generation than a can lead to it, so the search stops at
+// that generation, and at any branch head whose bitmap can answer directly
+static int commit_is_ancestor(struct helper *helper, struct commit *a,
+                                                     struct commit *b) {
+    if(a == b) {
+        return 1;
+    }
+    if(a->generation >= b->generation) {
+        return 0; // Ancestors always have a lower generation
+    }
+    // Branch heads keep a bitmap, made the first time it is asked for
+    if(b->heads > 0) {
+        size_t words;
+        uint64_t *reach = commit_reach(helper, b, &words);
+        return reach_has(reach, words, a);
+    }
+    unsigned char *seen = calloc(helper->n_commits, 1);
+    struct commit **stack = malloc(sizeof(struct commit *)
+                                   * (helper->n_commits + 1));
+    if(seen == NULL || stack == NULL) {
+        exit(1); // An error has occurred
+    }
+    size_t n = 0;
+    int found = 0;
+    stack[n++] = b;
+    seen[b->seq] = 1;
+    while(n > 0 && !found) {
+        struct commit *commit = stack[--n];
+        size_t words;
+        uint64_t *reach = head_reach(commit, &words);
+        if(reach != NULL) {
+            found = reach_has(reach, words, a);
+            continue;
+        }
+        for(size_t i = 0; i < commit->n_parents; i++) {
+            struct commit *parent = commit->parents[i];
+            if(parent == a) {
+                found = 1;
+            } else if(!seen[parent->seq]
+                   && parent->generation > a->generation) {
+                seen[parent->seq] = 1;
+                stack[n++] = parent;
+            }
+        }
+    }
+    free(stack);
+    free(seen);
+    return found;
+}
+
+// Helper function to move a branch to a new head, which may be NULL. Each
+// commit counts the branches it is the head of, and its bitmap is freed
+// once it is the head of none
+static void branch_set_head(struct helper *helper, struct branch *branch,
+                            struct commit *commit) {
+    struct commit *old = branch->head;
+    branch->head = commit;
+    if(commit != NULL) {
+        commit->heads++;
+    }
+    if(old != NULL && --old->heads == 0 && old->reach != NULL) {
+        helper->reach_words -= old->reach_words;
+        free(old->reach);
+        old->reach = NULL;
+        old->reach_words = 0;
+    }
+}
+
+// Helper function to find the bitmap of a commit that is the head of a
+// branch, or NULL if it has not been made
+static uint64_t *head_reach(struct commit *commit, size_t *words) {
+    *words = commit->reach_words;
+    return commit->reach;
+}
+
+// Helper function to get the bitmap of commits a branch head reaches,
+// making it if the head has moved since it was last made. Every branch at
+// that head shares it
+static uint64_t *commit_reach(struct helper *helper, struct commit *commit,
+                                                     size_t *words) {
+    if(commit->reach == NULL) {
+        commit->reach = reach_build(helper, commit, &commit->reach_words);
+        helper->reach_words += commit->reach_words;
+    }
+    *words = commit->reach_words;
+    return commit->reach;
+}
+
+// Helper function to make a bitmap with a bit set for each commit that a
+// commit reaches, including itself. Bits are numbered by commit->seq, and
+// parents are always made before their children, so the bitmap only needs
+// as many bits as the commit's own seq. Walking stops at branch heads that
+// already have a bitmap
+static uint64_t *reach_build(struct helper *helper, struct commit *commit,
+                                                    size_t *words) {
+    *words = commit->seq / 64 + 1;
+    uint64_t *reach = calloc(*words, sizeof(uint64_t));
+    struct commit **stack = malloc(sizeof(struct commit *)
+                                   * (helper->n_commits + 1));
+    if(reach == NULL || stack == NULL) {
+        exit(1); // An error has occurred
+    }
+    size_t n = 0;
+    reach[commit->seq / 64] |= (uint64_t)1 << (commit->seq % 64);
+    stack[n++] = commit;
+    while(n > 0) {
+        struct commit *c = stack[--n];
+        for(size_t i = 0; i < c->n_parents; i++) {
+            struct commit *parent = c->parents[i];
+            if(reach_has(reach, *words, parent)) {
+                continue; // Already reached
+            }
+            size_t parent_words;
+            uint64_t *known = head_reach(parent, &parent_words);
+            if(known != NULL) {
+                // Take everything the parent reaches at once
+                for(size_t j = 0; j < parent_words; j++) {
+                    reach[j] |= known[j];
+                }
+                continue;
+            }
+            reach[parent->seq / 64] |= (uint64_t)1 << (parent->seq % 64);
+            stack[n++] = parent;
+        }
+    }
+    free(stack);
+    return reach;
+}
+
+// Helper function to check if a commit's bit is set in a bitmap
+static int reach_has(uint64_t *reach, size_t words, struct commit *commit) {
+    if(commit->seq / 64 >= words) {
+        return 0; // Made after every commit in the bitmap
+    }
+    return (reach[commit->seq / 64] >> (commit->seq % 64)) & 1;
+}
+
+// Helper function to add a commit to a heap ordered by generation, highest
+// first, then by the order commits were made, newest first. A heap with
+// by_seq set is only ordered by when commits were made
+static void commit_heap_push(struct commit_heap *heap, struct commit *commit) {
+    if(heap->n == heap->cap) {
+        size_t cap = heap->cap == 0 ? 16 : heap->cap * 2;
+        struct commit **temp = realloc(heap->commits,
+                                       sizeof(struct commit *) * cap);
+        if(temp == NULL) {
+            exit(1); // An error has occurred
+        }
+        heap->commits = temp;
+        heap->cap = cap;
+    }
+    // Move the commit up until its parent in the heap comes before it
+    size_t i = heap->n++;
+    while(i > 0 && commit_heap_before(heap, commit,
+                                      heap->commits[(i - 1) / 2])) {
+        heap->commits[i] = heap->commits[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap->commits[i] = commit;
+}
+
+// Helper function to take the first commit from a heap
+static struct commit *commit_heap_pop(struct commit_heap *heap) {
+    struct commit *top = heap->commits[0];
+    struct commit *last = heap->commits[--heap->n];
+    // Move the last commit down from the top until it is in order
+    size_t i = 0;
+    while(1) {
+        size_t child = i * 2 + 1;
+        if(child >= heap->n) {
+            break;
+        }
+        if(child + 1 < heap->n && commit_heap_before(heap,
+                          heap->commits[child + 1], heap->commits[child])) {
+            child++;
+        }
+        if(!commit_heap_before(heap, heap->commits[child], last)) {
+            break;
+        }
+        heap->commits[i] = heap->commits[child];
+        i = child;
+    }
+    heap->commits[i] = last;
+    return top;
+}
+
+// Helper function to check if a commit comes before another in a heap
+static int commit_heap_before(struct commit_heap *heap, struct commit *a,
+                                                       struct commit *b) {
+    if(!heap->by_seq && a->generation != b->generation) {
+        return a->generation > b->generation;
+    }
+    return a->seq > b->seq;
+}
+
+// Start walking the history of a commit, or of the current branch's head if
+// commit_id is NULL. Commits come out of svc_log_next newest first, by when
+// they were made (SVC_LOG_DATE) or by generation (SVC_LOG_TOPO), and a
+// commit always comes before its parents. SVC_LOG_FIRST_PARENT only follows
+// the first parent of merges. If path is given, only commits that changed
+// that file come out. Returns NULL if the commit does not exist
+struct svc_log *svc_log_open(void *helper, char *commit_id, int flags,
+                                                            char *path) {
+    if(helper == NULL) {
+        return NULL; // Defensive checks
+    }
+    struct helper *h = (struct helper *)helper;
+    struct commit *start = commit_id == NULL ? h->current_branch->head
+                                             : get_commit(h, commit_id);
+    if(commit_id != NULL && start == NULL) {
+        return NULL; // No such commit
+    }
+    struct svc_log *log = malloc(sizeof(struct svc_log));
+    if(log == NULL) {
+        return NULL; // An error has occurred
+    }
+    log->helper = h;
+    log->heap.commits = NULL;
+    log->heap.n = 0;
+    log->heap.cap = 0;
+    log->heap.by_seq = !(flags & SVC_LOG_TOPO);
+    log->flags = flags;
+    log->seen = NULL;
+    log->path = NULL;
+    log->done = start == NULL;
+    if(path != NULL) {
+        // Older commits' changes are only read when they are needed, so
+        // the path may not have been seen yet even if a commit changed it
+        log->path = intern_path(h, path, strlen(path));
+    }
+    // Following only first parents never meets a commit twice, otherwise
+    // remember which commits have been queued
+    if(!(flags & SVC_LOG_FIRST_PARENT)) {
+        log->seen = calloc(h->n_commits / 64 + 1, sizeof(uint64_t));
+        if(log->seen == NULL) {
+            free(log);
+            return NULL; // An error has occurred
+        }
+    }
+    if(!log->done) {
+        log_push(log, start);
+    }
+    return log;
+}
+
+// Get the next commit of a walk started by svc_log_open, or NULL when there
+// are no more. Nothing is allocated once the walk is under way, and only
+// commits waiting to be visited are held
+void *svc_log_next(struct svc_log *log) {
+    if(log == NULL) {
+        return NULL; // Defensive checks
+    }
+    while(!log->done && log->heap.n > 0) {
+        struct commit *commit = commit_heap_pop(&log->heap);
+        size_t n_parents = commit->n_parents;
+        if((log->flags & SVC_LOG_FIRST_PARENT) && n_parents > 1) {
+            n_parents = 1;
+        }
+        for(size_t i = 0; i < n_parents; i++) {
+            log_push(log, commit->parents[i]);
+        }
+        if(log->path == NULL
+           || commit_changes_path(log->helper, commit, log->path)) {
+            return commit;
+        }
+    }
+    return NULL;
+}
+
+// Finish a walk started by svc_log_open
+void svc_log_close(struct svc_log *log) {
+    if(log == NULL) {
+        return;
+    }
+    free(log->heap.commits);
+    free(log->seen);
+    free(log);
+}
+
+// Helper function to queue a commit in a walk unless it was already queued
+static void log_push(struct svc_log *log, struct commit *commit) {
+    if(log->seen != NULL) {
+        uint64_t bit = (uint64_t)1 << (commit->seq % 64);
+        if(log->seen[commit->seq / 64] & bit) {
+            return; // Already queued
+        }
+        log->seen[commit->seq / 64] |= bit;
+    }
+    commit_heap_push(&log->heap, commit);
+}
+
+// Helper function to check if a commit changed a file. The changes are
+// sorted, so this is a binary search
+static int commit_changes_path(struct helper *helper, struct commit *commit,
+                                                       struct path *path) {
+    commit_read_files(helper, commit);
+    // Find the first change that does not sort before the path
+    size_t low = 0;
+    size_t high = commit->n_files;
+    while(low < high) {
+        size_t mid = low + (high - low) / 2;
+        if(path_compare(commit->files[mid].path, path) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    // The order ignores case, so check every path that sorts the same
+    for(size_t i = low; i < commit->n_files; i++) {
+        if(commit->files[i].path == path) {
+            return 1;
+        }
+        if(path_compare(commit->files[i].path, path) != 0) {
+            break;
+        }
+    }
+    return 0;
+}
+
+// Forget every commit that no branch reaches, such as those left behind by
+// svc_reset, and start removing the stored files that only they used. Files
+// are removed on a thread of their own, no faster than bytes_per_sec if it
+// is not 0, and commits can be made while it runs. Returns the number of
+// commits forgotten, -1 if an error occurs, or -2 if the last collection
+// has not been waited for with svc_gc_wait
+int svc_gc(void *helper, size_t bytes_per_sec) {
+    if(helper == NULL) {
+        return -1; // Defensive checks
+    }
+    struct helper *h = (struct helper *)helper;
+    if(h->gc.running) {
+        return -2; // Still sweeping
+    }
+    // Mark every commit a branch reaches
+    size_t words = h->n_commits / 64 + 1;
+    uint64_t *reach = calloc(words, sizeof(uint64_t));
+    struct commit **pruned = malloc(sizeof(struct commit *)
+                                    * (h->n_commits + 1));
+    if(reach == NULL || pruned == NULL) {
+        exit(1); // An error has occurred
+    }
+    for(size_t i = 0; i < h->n_branches; i++) {
+        if(h->branches[i]->head == NULL) {
+            continue; // Nothing committed on it
+        }
+        size_t branch_words;
+        uint64_t *branch = commit_reach(h, h->branches[i]->head,
+                                        &branch_words);
+        for(size_t j = 0; j < branch_words; j++) {
+            reach[j] |= branch[j];
+        }
+    }
+    // The objects to keep are those stored by the commits that are reached.
+    // Every file of a commit was stored by it or by one of its ancestors
+    struct digest_set live = {NULL, 0, 0};
+    size_t n_pruned = 0;
+    for(size_t i = 0; i < h->n_commits; i++) {
+        struct commit *commit = h->commits[i];
+        if(commit->pruned) {
+            continue; // Already forgotten
+        }
+        if(!reach_has(reach, words, commit)) {
+            pruned[n_pruned++] = commit;
+            continue;
+        }
+        commit_read_files(h, commit);
+        for(size_t j = 0; j < commit->n_files; j++) {
+            if(commit->files[j].change != 'D') {
+                digest_set_add(&live, commit->files[j].digest);
+            }
+        }
+    }
+    free(reach);
+    // Record the forgotten commits before anything is removed
+    if(n_pruned > 0 && journal_write_prune(h, pruned, n_pruned) != 0) {
+        free(pruned);
+        free(live.slots);
+        return -1; // An error has occurred
+    }
+    for(size_t i = 0; i < n_pruned; i++) {
+        pruned[i]->pruned = 1;
+    }
+    if(n_pruned > 0) {
+        commit_index_rebuild(h);
+    }
+    free(pruned);
+
+    // Sweep the objects in the background
+    h->gc.live = live;
+    memset(&h->gc.kept, 0, sizeof(h->gc.kept));
+    h->gc.stop = 0;
+    h->gc.bytes_per_sec = bytes_per_sec;
+    h->gc.removed = 0;
+    if(pthread_create(&h->gc.thread, NULL, gc_sweep, h) != 0) {
+        free(h->gc.live.slots);
+        return -1; // An error has occurred
+    }
+    h->gc.running = 1;
+    return (int)n_pruned;
+}
+
+// Wait for the objects of the last svc_gc to be removed. Returns how many
+// were removed, or -1 if no collection was started
+int svc_gc_wait(void *helper) {
+    if(helper == NULL) {
+        return -1; // Defensive checks
+    }
+    struct helper *h = (struct helper *)helper;
+    if(!h->gc.running) {
+        return -1; // Nothing to wait for
+    }
+    pthread_join(h->gc.thread, NULL);
+    h->gc.running = 0;
+    free(h->gc.live.slots);
+    free(h->gc.kept.slots);
+    return (int)h->gc.removed;
+}
+
+// Helper function to stop a sweep early and wait for it to finish
+static void gc_stop(struct helper *helper) {
+    if(!helper->gc.running) {
+        return;
+    }
+    pthread_mutex_lock(&helper->gc.lock);
+    helper->gc.stop = 1;
+    pthread_cond_broadcast(&helper->gc.wake);
+    pthread_mutex_unlock(&helper->gc.lock);
+    svc_gc_wait(helper);
+}
+
+// Helper function to stop a sweep from removing an object that a commit
+// is about to use
+static void gc_keep(struct helper *helper, uint64_t digest) {
+    if(!helper->gc.running) {
+        return; // Nothing is being removed
+    }
+    pthread_mutex_lock(&helper->gc.lock);
+    digest_set_add(&helper->gc.kept, digest);
+    pthread_mutex_unlock(&helper->gc.lock);
+}
+
+// Thread that removes every object that is not live. Only the repository's
+// directory and the collector's own state are used, so the helper can be
+// used for everything else meanwhile
+static void *gc_sweep(void *arg) {
+    struct helper *h = (struct helper *)arg;
+    char *arr[] = {h->dir, "/", OBJECTS_DIR};
+    char *objects = str_concat(arr, 3);
+    if(objects == NULL) {
+        return NULL; // An error has occurred
+    }
+    // List the objects first, so none are missed or seen twice as they are
+    // removed
+    struct file_list names = {NULL, 0, 0};
+    DIR *dir = opendir(objects);
+    if(dir != NULL) {
+        struct dirent *entry;
+        while((entry = readdir(dir)) != NULL) {
+            uint64_t digest;
+            int is_delta;
+            if(parse_object_name(entry->d_name, &digest, &is_delta) == 0 &&
+               file_list_push(&names, entry->d_name) != 0) {
+                break; // An error has occurred
+            }
+        }
+        closedir(dir);
+    }
+    // The full copies that live deltas are rebuilt from are live as well
+    for(size_t i = 0; i < names.n; i++) {
+        uint64_t digest;
+        int is_delta;
+        parse_object_name(names.names[i], &digest, &is_delta);
+        if(is_delta && digest_set_has(&h->gc.live, digest)) {
+            char *path_arr[] = {objects, "/", names.names[i]};
+            char *path = str_concat(path_arr, 3);
+            struct delta_header header;
+            if(path != NULL && read_delta_header(path, &header) == 0) {
+                digest_set_add(&h->gc.live, header.base);
+            }
+            free(path);
+        }
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t bytes = 0;
+    for(size_t i = 0; i < names.n; i++) {
+        if(gc_sweep_object(h, objects, names.names[i], &start, &bytes) != 0) {
+            break; // Stopped
+        }
+    }
+    free_file_list(&names);
+    free(objects);
+    return NULL;
+}
+
+// Helper function to remove one object if it is not live, then wait until
+// the bytes removed since start are within the collector's limit. Returns
+// -1 if the sweep has been told to stop
+static int gc_sweep_object(struct helper *helper, char *objects, char *name,
+                                                  struct timespec *start,
+                                                  size_t *bytes) {
+    struct gc_state *gc = &helper->gc;
+    uint64_t digest;
+    int is_delta;
+    parse_object_name(name, &digest, &is_delta);
+    if(digest_set_has(&gc->live, digest)) {
+        return 0; // Still used
+    }
+    char *arr[] = {objects, "/", name};
+    char *path = str_concat(arr, 3);
+    if(path == NULL) {
+        return 0; // An error has occurred
+    }
+    pthread_mutex_lock(&gc->lock);
+    // Objects that commits have used since the sweep started are kept
+    struct stat st;
+    if(!gc->stop && !digest_set_has(&gc->kept, digest) &&
+       stat(path, &st) == 0 && unlink(path) == 0) {
+        gc->removed++;
+        *bytes += st.st_blocks * 512;
+        // Wait until the bytes removed are within the limit. The lock is
+        // let go while waiting, so commits are not held up
+        if(gc->bytes_per_sec > 0) {
+            uint64_t ns = (uint64_t)((double)*bytes / gc->bytes_per_sec
+                                     * 1e9);
+            struct timespec until = *start;
+            until.tv_sec += ns / 1000000000;
+            until.tv_nsec += ns % 1000000000;
+            if(until.tv_nsec >= 1000000000) {
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000;
+            }
+            while(!gc->stop && pthread_cond_timedwait(&gc->wake, &gc->lock,
+                                                      &until) == 0) {
+                // Woken early, so check whether to stop
+            }
+        }
+    }
+    int stop = gc->stop;
+    pthread_mutex_unlock(&gc->lock);
+    free(path);
+    return stop ? -1 : 0;
+}
+
+// Helper function to find the digest an object's file is named by. Returns
+// -1 if it is not an object, such as a copy still being written
+static int parse_object_name(const char *name, uint64_t *digest,
+                             int *is_delta) {
+    size_t len = strlen(name);
+    *is_delta = len == 16 + strlen(DELTA_SUFFIX) &&
+                strcmp(name + 16, DELTA_SUFFIX) == 0;
+    if(len != 16 && !*is_delta) {
+        return -1;
+    }
+    *digest = 0;
+    for(size_t i = 0; i < 16; i++) {
+        char c = name[i];
+        int value;
+        if(c >= '0' && c <= '9') {
+            value = c - '0';
+        } else if(c >= 'a' && c <= 'f') {
+            value = c - 'a' + 10;
+        } else {
+            return -1; // Not a digest
+        }
+        *digest = (*digest << 4) | (uint64_t)value;
+    }
+    return 0;
+}
+
+// Helper function to add a digest to a set, growing it if needed
+static void digest_set_add(struct digest_set *set, uint64_t digest) {
+    if(digest == 0) {
+        return; // 0 marks empty slots, and is never a stored digest
+    }
+    // Keep the set at most half full so probe sequences stay short
+    if((set->n + 1) * 2 > set->size) {
+        size_t new_size = set->size == 0 ? 64 : set->size * 2;
+        uint64_t *slots = calloc(new_size, sizeof(uint64_t));
+        if(slots == NULL) {
+            exit(1); // An error has occurred
+        }
+        for(size_t i = 0; i < set->size; i++) {
+            if(set->slots[i] != 0) {
+                size_t j = set->slots[i] & (new_size - 1);
+                while(slots[j] != 0) {
+                    j = (j + 1) & (new_size - 1);
+                }
+                slots[j] = set->slots[i];
+            }
+        }
+        free(set->slots);
+        set->slots = slots;
+        set->size = new_size;
+    }
+    // Digests are already well mixed, so their low bits pick the slot
+    size_t mask = set->size - 1;
+    size_t i = digest & mask;
+    while(set->slots[i] != 0) {
+        if(set->slots[i] == digest) {
+            return; // Already in the set
+        }
+        i = (i + 1) & mask;
+    }
+    set->slots[i] = digest;
+    set->n++;
+}
+
+// Helper function to check if a digest is in a set
+static int digest_set_has(struct digest_set *set, uint64_t digest) {
+    if(set->size == 0 || digest == 0) {
+        return 0;
+    }
+    size_t mask = set->size - 1;
+    for(size_t i = digest & mask; set->slots[i] != 0; i = (i + 1) & mask) {
+        if(set->slots[i] == digest) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Only keep tracked files matching one of patterns in the workspace, such
+// as "src/lib/" for everything under a directory or "*.h". Patterns ending
+// in '/' take in everything under that directory, and others are matched
+// with fnmatch, where '*' also matches '/'. Files left out are not copied,
+// looked at or hashed by checkouts, merges and commits, and cannot be
+// added. No patterns keeps every file. Returns 0, -1 if an error occurs,
+// or -2 if there are uncommitted changes
+int svc_set_sparse(void *helper, char **patterns, int n_patterns) {
+    if(helper == NULL || n_patterns < 0 ||
+       (n_patterns > 0 && patterns == NULL)) {
+        return -1; // Defensive checks
+    }
+    for(int i = 0; i < n_patterns; i++) {
+        if(patterns[i] == NULL) {
+            return -1; // Defensive checks
+        }
+    }
+    struct helper *h = (struct helper *)helper;
+    if(check_changes(h)) {
+        return -2; // Uncommitted changes
+    }
+    // Record the patterns first, so svc_open uses them too
+    if(journal_write_sparse(h, patterns, n_patterns) != 0) {
+        return -1; // An error has occurred
+    }
+    struct branch *branch = h->current_branch;
+    char *before = malloc(sizeof(char) * (branch->n_files + 1));
+    size_t *jobs = malloc(sizeof(size_t) * (branch->n_files + 1));
+    int *results = malloc(sizeof(int) * (branch->n_files + 1));
+    if(before == NULL || jobs == NULL || results == NULL) {
+        exit(1); // An error has occurred
+    }
+    for(size_t i = 0; i < branch->n_files; i++) {
+        before[i] = !not_in_workspace(&branch->files[i]);
+    }
+    sparse_set(h, patterns, n_patterns);
+
+    // Remove the unchanged files that are now left out, and copy in the
+    // ones that are now kept
+    size_t n_jobs = 0;
+    for(size_t i = 0; i < branch->n_files; i++) {
+        struct tracked_file *file = &branch->files[i];
+        int after = !not_in_workspace(file);
+        if(before[i] && !after) {
+            struct stat st;
+            if(file->change == 'N' && stat(file->path->name, &st) == 0 &&
+               file_unchanged(h, file, &st)) {
+                unlink(file->path->name);
+            }
+            file->cache.inode = 0;
+        } else if(!before[i] && after) {
+            jobs[n_jobs++] = i;
+        }
+    }
+    restore_files(h, branch->files, jobs, n_jobs, results);
+    int ret = 0;
+    for(size_t i = 0; i < n_jobs; i++) {
+        if(results[i] != 0) {
+            ret = -1; // An error has occurred
+        }
+    }
+    free(before);
+    free(jobs);
+    free(results);
+    return ret;
+}
+
+// Set whether checkouts, resets and merges leave the files they would copy
+// out of the workspace, only recording which blob each one needs. Those
+// files are copied in by svc_hydrate, and until then are neither looked
+// at nor hashed, so must not be written any other way
+void svc_set_lazy(void *helper, int lazy) {
+    if(helper == NULL) {
+        return; // Defensive checks
+    }
+    ((struct helper *)helper)->lazy = lazy != 0;
+}
+
+// Copy the files a lazy checkout left out into the workspace. path is a
+// tracked file, a directory ending in '/' to copy everything under it, or
+// NULL to copy every file. Files outside the sparse patterns stay out.
+// Returns the number of files copied, or -1 if an error occurs
+int svc_hydrate(void *helper, char *path) {
+    if(helper == NULL) {
+        return -1; // Defensive checks
+    }
+    struct helper *h = (struct helper *)helper;
+    struct branch *branch = h->current_branch;
+    size_t *jobs = malloc(sizeof(size_t) * (branch->n_files + 1));
+    int *results = malloc(sizeof(int) * (branch->n_files + 1));
+    if(jobs == NULL || results == NULL) {
+        exit(1); // An error has occurred
+    }
+    size_t n_jobs = 0;
+    size_t len = path == NULL ? 0 : strlen(path);
+    if(len > 0 && path[len - 1] != '/') {
+        // A single file is found through the branch's index
+        long i = branch_find_file(h, branch, path);
+        if(i != -1 && branch->files[i].lazy && branch->files[i].digest != 0
+           && branch->files[i].path->in_sparse
+           && !lazy_taken(h, &branch->files[i])) {
+            jobs[n_jobs++] = i;
+        }
+    } else {
+        for(size_t i = 0; i < branch->n_files; i++) {
+            struct tracked_file *file = &branch->files[i];
+            if(file->lazy && file->digest != 0 && file->path->in_sparse &&
+               strncmp(file->path->name, path == NULL ? "" : path, len) == 0
+               && !lazy_taken(h, file)) {
+                jobs[n_jobs++] = i;
+            }
+        }
+    }
+    // Copy them in one batch, keeping the signature of each as it is written
+    restore_files(h, branch->files, jobs, n_jobs, results);
+    int ret = 0;
+    for(size_t i = 0; i < n_jobs; i++) {
+        if(results[i] != 0) {
+            ret = -1; // An error has occurred
+        } else {
+            branch->files[jobs[i]].lazy = 0;
+            if(ret >= 0) {
+                ret++;
+            }
+        }
+    }
+    free(jobs);
+    free(results);
+    return ret;
+}
+
+// Helper function to check if a path is matched by the sparse patterns
+static int sparse_matches(struct helper *helper, const char *name) {
+    if(helper->n_sparse == 0) {
+        return 1; // Every file is kept
+    }
+    for(size_t i = 0; i < helper->n_sparse; i++) {
+        char *pattern = helper->sparse[i];
+        size_t len = strlen(pattern);
+        if(len > 0 && pattern[len - 1] == '/') {
+            // Everything under a directory
+            if(strncmp(name, pattern, len) == 0) {
+                return 1;
+            }
+        } else if(fnmatch(pattern, name, 0) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Helper function to check if a tracked file is left out of the workspace,
+// by the sparse patterns or until it is hydrated. Its contents are already
+// stored, so it is never looked at
+static int not_in_workspace(struct tracked_file *file) {
+    return (!file->path->in_sparse || file->lazy) && file->digest != 0;
+}
+
+// Helper function to check for a file created where one is still to be
+// hydrated. It is taken as hydrated and hashed, so that it is seen as a
+// change instead of being overwritten. Returns 1 if there was one
+static int lazy_taken(struct helper *helper, struct tracked_file *file) {
+    struct stat st;
+    if(!file->lazy || !file->path->in_sparse
+       || lstat(file->path->name, &st) != 0) {
+        return 0;
+    }
+    file->lazy = 0;
+    hash_tracked_file(helper, file);
+    return 1;
+}
+
+// Helper function to replace the sparse patterns with copies of patterns,
+// and work out again which paths they keep
+static void sparse_set(struct helper *helper, char **patterns, size_t n) {
+    for(size_t i = 0; i < helper->n_sparse; i++) {
+        free(helper->sparse[i]);
+    }
+    free(helper->sparse);
+    helper->sparse = malloc(sizeof(char *) * (n + 1));
+    if(helper->sparse == NULL) {
+        exit(1); // An error has occurred
+    }
+    for(size_t i = 0; i < n; i++) {
+        helper->sparse[i] = malloc(sizeof(char) * (strlen(patterns[i]) + 1));
+        if(helper->sparse[i] == NULL) {
+            exit(1); // An error has occurred
+        }
+        strcpy(helper->sparse[i], patterns[i]);
+    }
+    helper->n_sparse = n;
+    for(size_t i = 0; i < helper->paths.n_paths; i++) {
+        struct path *path = helper->paths.paths[i];
+        path->in_sparse = sparse_matches(helper, path->name);
+    }
+}
+
+// Helper function to separate calculating the commit id from commit function
+void set_commit_id(struct commit* commit) {
+    if(commit == NULL) {
+        return; // Defensive checking
+    }
+    // The algorithm
+    int id = 0;
+    // Looping for the commit message
+    for(size_t i = 0; i < strlen(commit->message); i++) {
+        id += (unsigned char) commit->message[i];
+    }
+    id %= 1000; // Same as doing modulus every loop
+    // Sort the array of files
+    qsort(commit->files, commit->n_files, sizeof(struct tracked_file), compar);
+    // Looping for changes in the commit
+    for(size_t i = 0; i < commit->n_files; i++) {
+        char c = commit->files[i].change;
+        if(c == 'A') {
+            id += 376591; // Change is addition
+        } else if (c == 'D') {
+            id += 85973; // Change is deletion
+        } else if (c == 'M') {
+            id += 9573681; // Change is modification
+        }
+        if(c != 'N') {
+            // Loop through file name if change is not NONE
+            for(size_t j = 0; j < commit->files[i].path->len; j++) {
+                unsigned char k = (unsigned char) commit->files[i].path->name[j];
+                id = ((id * (k % 37)) % 15485863) + 1;
+            }
+        }
+    }
+    // Put id as a hex in commit
+    sprintf(commit->id, "%06x", id);
+}
+
+// Comparator for sorting strings alphabetically ignoring upper and lower case
+int compar(const void *a, const void *b) {
+    // Comparator for 2 tracked files
+    return path_compare(((struct tracked_file *)a)->path,
+                        ((struct tracked_file *)b)->path);
+}
+
+// Helper function to order two paths alphabetically ignoring upper and lower
+// case, with a name coming before any longer name it starts. The sort keys
+// are made when a path is stored, so this is a single memcmp
+static int path_compare(const struct path *a, const struct path *b) {
+    if(a == b) {
+        return 0; // Same path
+    }
+    // Only need to compare up to the length of the shorter name
+    uint32_t max = a->len < b->len ? a->len : b->len;
+    int ret = memcmp(a->key, b->key, max);
+    if(ret != 0) {
+        return ret < 0 ? -1 : 1;
+    }
+    // The names are the same for the first (max) letters
+    if(a->len == b->len) {
+        return 0; // Names are same length so they are equal
+    }
+    return a->len < b->len ? -1 : 1; // The shorter comes first
+}
+
+// Helper function to find a path tracked by a commit, or NULL if the commit
+// did not have the file
+static struct tree_node *find_commit_file(struct helper *helper,
+                                          struct commit *commit,
+                                          struct path *path) {
+    if(commit == NULL || path == NULL) {
+        return NULL; // Defensive checks
+    }
+    return tree_find(commit_tree(helper, commit), path);
+}
+
+// Helper function for removing files from a tracked_file list
+void remove_tracked_files(struct branch *branch, int *arr, int rem_count) {
+    if(rem_count == 0) {
+        return; // Nothing to remove
+    }
+    int new_size = branch->n_files - rem_count;
+    // Case where every element gets removed
+    if(new_size == 0) {
+        free(branch->files);
+        branch->files = NULL;
+        branch->n_files = 0;
+        branch->files_cap = 0;
+        branch_index_rebuild(branch);
+        return;
+    }
+    // Otherwise create a new list
+    struct tracked_file *temp = malloc(sizeof(struct tracked_file) * new_size);
+    if(temp == NULL) {
+        exit(1); // An error has occurred
+    }
+    int count = 0;
+    for(size_t i = 0; i < branch->n_files; i++) {
+        if(arr[i] != 1) {
+            // Copy to new list if not marked for removal
+            temp[count].path = branch->files[i].path;
+            temp[count].hash = branch->files[i].hash;
+            temp[count].digest = branch->files[i].digest;
+            temp[count].cache = branch->files[i].cache;
+            temp[count].change = branch->files[i].change;
+            temp[count].lazy = branch->files[i].lazy;
+            count++;
+        }
+    }
+    // Free the old list
+    free(branch->files);
+    // Update the branch to point to the new list
+    branch->files = temp;
+    branch->n_files = new_size;
+    branch->files_cap = new_size;
+    branch_index_rebuild(branch);
+}
+
+// Helper function to find a branch's tracked file by name. Returns its
+// position in branch->files, or -1 if it is not being tracked
+static long branch_find_file(struct helper *helper, struct branch *branch,
+                                                     char *file_name) {
+    // A name that was never stored cannot be tracked
+    struct path *path = find_path(helper, file_name);
+    if(path == NULL) {
+        return -1;
+    }
+    return branch_find_path(branch, path);
+}
+
+// Helper function to find a branch's tracked file by path. Returns its
+// position in branch->files, or -1 if it is not being tracked
+static long branch_find_path(struct branch *branch, struct path *path) {
+    if(branch->file_index == NULL) {
+        return -1; // Nothing is tracked
+    }
+    size_t mask = branch->file_index_size - 1;
+    for(size_t i = path_slot(path) & mask;
+        branch->file_index[i] != 0; i = (i + 1) & mask) {
+        // Slots hold the position plus one, so 0 can mean empty
+        size_t pos = branch->file_index[i] - 1;
+        if(branch->files[pos].path == path) {
+            return pos;
+        }
+    }
+    return -1;
+}
+
+// Helper function to spread path ids over the slots of a table
+static size_t path_slot(struct path *path) {
+    return (size_t)path->id * 2654435761u;
+}
+
+// Helper function to add the file at a position to the branch's index
+static void branch_index_add(struct branch *branch, size_t pos) {
+    size_t mask = branch->file_index_size - 1;
+    size_t i = path_slot(branch->files[pos].path) & mask;
+    while(branch->file_index[i] != 0) {
+        i = (i + 1) & mask;
+    }
+    branch->file_index[i] = pos + 1;
+}
+
+// Helper function to rebuild a branch's index after its files have moved.
+// The index has at least twice as many slots as the list has room for, so
+// it never gets more than half full
+static void branch_index_rebuild(struct branch *branch) {
+    size_t size = 16;
+    while(size < branch->files_cap * 2) {
+        size *= 2;
+    }
+    if(size != branch->file_index_size) {
+        free(branch->file_index);
+        branch->file_index = malloc(sizeof(size_t) * size);
+        if(branch->file_index == NULL) {
+            exit(1); // An error has occurred
+        }
+        branch->file_index_size = size;
+    }
+    memset(branch->file_index, 0, sizeof(size_t) * size);
+    for(size_t i = 0; i < branch->n_files; i++) {
+        branch_index_add(branch, i);
+    }
+}
+
+// Helper function to make room for at least n tracked files. The list
+// doubles in size so adding files one at a time is amortised O(1)
+static int branch_reserve(struct branch *branch, size_t n) {
+    if(n <= branch->files_cap) {
+        return 0; // Already enough room
+    }
+    size_t cap = branch->files_cap * 2;
+    if(cap < n) {
+        cap = n;
+    }
+    if(cap < 8) {
+        cap = 8;
+    }
+    struct tracked_file *temp = realloc(branch->files,
+                                sizeof(struct tracked_file) * cap);
+    if(temp == NULL) {
+        return -1; // An error has occurred
+    }
+    branch->files = temp;
+    branch->files_cap = cap;
+    branch_index_rebuild(branch);
+    return 0;
+}
+
+// Helper function to hash the tracked file for one job of svc_add_many or
+// check_changes
+static void hash_job(void *arg, size_t i) {
+    struct hash_job_args *args = arg;
+    hash_tracked_file(args->helper, &args->files[args->positions[i]]);
+}
+
+// Helper function to hash a file about to be committed. Added files are
+// hashed again, and every changed file needs the digest naming its blob
+static void commit_hash_job(void *arg, size_t i) {
+    struct hash_job_args *args = arg;
+    struct tracked_file *file = &args->files[args->positions[i]];
+    if(not_in_workspace(file)) {
+        return; // Not in the workspace, and its contents are stored
+    }
+    if(file->change == 'A') {
+        // Files restored by a merge or untouched since they were added
+        // still match what was hashed
+        struct stat st;
+        if(file->cache.inode == 0 || stat(file->path->name, &st) != 0
+        || !cache_matches(&file->cache, &st)) {
+            hash_tracked_file(args->helper, file);
+        }
+    }
+    if(file->digest == 0) {
+        struct stat st;
+        memset(&st, 0, sizeof(st));
+        file->hash = hash_file_digest(args->helper, file->path->name,
+                                                    &file->digest, &st);
+        cache_from_stat(&file->cache, &st);
+    }
+}
+
+// Set how many threads hash and copy files. 0 means one per processor and
+// 1 means everything is done on the calling thread
+void svc_set_threads(void *helper, int n_threads) {
+    if(helper == NULL || n_threads < 0) {
+        return; // Defensive checks
+    }
+    struct helper *h = (struct helper *)helper;
+    // The pool is started again at the new size when it is next needed
+    pool_destroy(h->pool);
+    h->pool = NULL;
+    h->n_threads = n_threads;
+}
+
+// Worker thread for the pool, runs jobs from each batch as they are posted
+static void *pool_worker(void *arg) {
+    struct thread_pool *pool = arg;
+    pthread_mutex_lock(&pool->lock);
+    while(1) {
+        // Wait for a job
+        while(!pool->stop && pool->next >= pool->n) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        if(pool->stop) {
+            break;
+        }
+        size_t i = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        pool->fn(pool->arg, i);
+        pthread_mutex_lock(&pool->lock);
+        pool->finished++;
+        if(pool->finished == pool->n) {
+            pthread_cond_signal(&pool->done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+// Helper function to start a pool of worker threads
+static struct thread_pool *pool_create(size_t n_threads) {
+    struct thread_pool *pool = malloc(sizeof(struct thread_pool));
+    if(pool == NULL) {
+        return NULL; // An error has occurred
+    }
+    pool->threads = malloc(sizeof(pthread_t) * n_threads);
+    if(pool->threads == NULL) {
+        free(pool);
+        return NULL; // An error has occurred
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->n = 0;
+    pool->next = 0;
+    pool->finished = 0;
+    pool->stop = 0;
+    pool->n_threads = 0;
+    while(pool->n_threads < n_threads && pthread_create(
+          &pool->threads[pool->n_threads], NULL, pool_worker, pool) == 0) {
+        pool->n_threads++;
+    }
+    return pool;
+}
+
+// Helper function to stop a pool's threads and free it
+static void pool_destroy(struct thread_pool *pool) {
+    if(pool == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for(size_t i = 0; i < pool->n_threads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->done);
+    free(pool->threads);
+    free(pool);
+}
+
+// Helper function to call fn(arg, i) for every i below n on the helper's
+// thread pool. Each call must only touch its own job's data, so results
+// come out the same however the jobs are spread over the threads
+static void parallel_for(struct helper *helper, size_t n,
+                         void (*fn)(void *, size_t), void *arg) {
+    size_t n_threads = helper->n_threads;
+    if(n_threads == 0) {
+        long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n_threads = n_cpus > 0 ? (size_t)n_cpus : 1;
+    }
+    if(n_threads > 1 && n > 1 && helper->pool == NULL) {
+        // The calling thread works too, so start one less
+        helper->pool = pool_create(n_threads - 1);
+    }
+    struct thread_pool *pool = helper->pool;
+    if(n_threads <= 1 || n <= 1 || pool == NULL) {
+        // Not worth using the pool
+        for(size_t i = 0; i < n; i++) {
+            fn(arg, i);
+        }
+        return;
+    }
+    // Post the batch
+    pthread_mutex_lock(&pool->lock);
+    pool->fn = fn;
+    pool->arg = arg;
+    pool->finished = 0;
+    pool->next = 0;
+    pool->n = n;
+    pthread_cond_broadcast(&pool->work);
+    // Help out from this thread too
+    while(pool->next < pool->n) {
+        size_t i = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        fn(arg, i);
+        pthread_mutex_lock(&pool->lock);
+        pool->finished++;
+    }
+    // Wait for the jobs other threads took to finish
+    while(pool->finished < pool->n) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pool->n = 0;
+    pool->next = 0;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Helper function to add a path to a list of paths
+static int file_list_push(struct file_list *list, char *path) {
+    if(list->n == list->cap) {
+        size_t cap = list->cap == 0 ? 64 : list->cap * 2;
+        char **temp = realloc(list->names, sizeof(char *) * cap);
+        if(temp == NULL) {
+            return -1; // An error has occurred
+        }
+        list->names = temp;
+        list->cap = cap;
+    }
+    char *copy = malloc(sizeof(char) * (strlen(path) + 1));
+    if(copy == NULL) {
+        return -1; // An error has occurred
+    }
+    strcpy(copy, path);
+    list->names[list->n++] = copy;
+    return 0;
+}
+
+// Helper function to free a list of paths
+static void free_file_list(struct file_list *list) {
+    for(size_t i = 0; i < list->n; i++) {
+        free(list->names[i]);
+    }
+    free(list->names);
+}
+
+// Helper function to stage every path in a list
+static int add_file_list(struct helper *helper, struct file_list *list) {
+    int *results = malloc(sizeof(int) * (list->n + 1));
+    if(results == NULL) {
+        return -1; // An error has occurred
+    }
+    int ret = svc_add_many(helper, list->names, list->n, results);
+    free(results);
+    return ret;
+}
+
+// Helper function to find every regular file under a directory, leaving
+// out the repository's own directory, which has the status in repo
+static int collect_files(struct helper *helper, char *dir_path,
+                         struct stat *repo, struct file_list *list) {
+    DIR *dir = opendir(dir_path);
+    if(dir == NULL) {
+        return -1; // An error has occurred
+    }
+    struct dirent *entry;
+    int ret = 0;
+    while(ret == 0 && (entry = readdir(dir)) != NULL) {
+        char *name = entry->d_name;
+        if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            continue;
+        }
+        // Paths under "." are tracked without the leading "./"
+        char *path;
+        if(strcmp(dir_path, ".") == 0) {
+            char *arr[] = {name};
+            path = str_concat(arr, 1);
+        } else {
+            char *arr[] = {dir_path, "/", name};
+            path = str_concat(arr, 3);
+        }
+        if(path == NULL) {
+            ret = -1; // An error has occurred
+            break;
+        }
+        struct stat st;
+        if(lstat(path, &st) != 0 || (st.st_ino == repo->st_ino &&
+                                     st.st_dev == repo->st_dev)) {
+            // Skip anything that has gone and the repository itself
+        } else if(S_ISDIR(st.st_mode)) {
+            ret = collect_files(helper, path, repo, list);
+        } else if(S_ISREG(st.st_mode)) {
+            ret = file_list_push(list, path);
+        }
+        free(path);
+    }
+    closedir(dir);
+    return ret;
+}
+
+// Helper function to concatenate two or more strings
+char *str_concat(char ** arr, size_t n_strings) {
+    if(arr == NULL || n_strings == 0) {
+        return NULL; // An error has occurred
+    }
+    // Figure out how long the new string will be
+    size_t size = 0;
+    for(size_t i = 0; i < n_strings; i++) {
+        size += strlen(arr[i]);
+    }
+    // Allocate memory for the new string including null terminator
+    char *new_string = malloc(sizeof(char)*(size + 1));
+    if(new_string == NULL) {
+        return NULL; // An error has occurred
+    }
+    // Copy the old strings into the new one
+    int cur = 0;
+    for(size_t i = 0; i < n_strings; i++) {
+        for(size_t j = 0; j < strlen(arr[i]); j++) {
+            new_string[cur] = arr[i][j];
+            cur++;
+        }
+    }
+    // Add a null terminator
+    new_string[size] = '\0';
+    return new_string;
+}
+
+// Helper function to check for uncommitted changes
+int check_changes(struct helper *helper) {
+    struct helper *h = helper;
+    struct branch *branch = h->current_branch;
+    // If no files are currently being tracked...
+    if(branch->files == NULL) {
+        return 0; // ...nothing to commit
+    }
+
+    // Check if tracked files can still be accessed
+    // An array to mark files for removal
+    int *r_list = malloc(sizeof(int) * branch->n_files);
+    // What each file looks like now, so unchanged files aren't read
+    struct stat *now = malloc(sizeof(struct stat) * branch->n_files);
+    if(r_list == NULL || now == NULL) {
+        exit(1); // An error has occurred
+    }
+    int r_count = 0;
+    for(size_t i = 0; i < branch->n_files; i++) {
+        r_list[i] = 0;
+        now[i].st_ino = 0;
+    }
+    // Make sure files have not been deleted
+    for(size_t i = 0; i < branch->n_files; i++) {
+        if(branch->files[i].change == 'c') {
+            // File was previously awaiting addition but a commit is occurring
+            r_list[i] = 1; // ... mark it for removal
+            r_count++;
+        }
+        // Files left out of the workspace are not looked at, unless one has
+        // been created where a file is still to be hydrated
+        lazy_taken(h, &branch->files[i]);
+        if(not_in_workspace(&branch->files[i])) {
+            continue;
+        }
+        // If file is not already marked for delete, check if was deleted
+        if(branch->files[i].change != 'D'){
+            // If cannot access
+            if(stat(branch->files[i].path->name, &now[i]) == -1) {
+                now[i].st_ino = 0;
+                // If the change was addition and now cannot be accessed...
+                if(branch->files[i].change == 'A'){
+                    // Mark it as awaiting addition
+                    branch->files[i].change = 'a';
+                } else {
+                    // Otherwise, mark it as pending deletion
+                    branch->files[i].change = 'd';
+                }
+            } else{
+                // If it can be accessed
+                // If change is awaiting addition
+                if(branch->files[i].change == 'a'){
+                    // It has now been added again
+                    branch->files[i].change = 'A';
+                } else if(branch->files[i].change == 'd') {
+                    // If it was pending deletion but can now be accessed...
+                    // ... set it to no change
+                    branch->files[i].change = 'N';
+                }
+            }
+        }
+    }
+    // Remove the files that were marked for removal
+    if(r_count > 0) {
+        size_t count = 0;
+        for(size_t i = 0; i < branch->n_files; i++) {
+            if(r_list[i] == 0) {
+                now[count++] = now[i];
+            }
+        }
+    }
+    remove_tracked_files(branch, r_list, r_count);
+    free(r_list);
+    // Check if there are any files left, awaiting addition does not count
+    int no_files = 1;
+    for(size_t i = 0; i < branch->n_files; i++) {
+        if(branch->files[i].change != 'a') {
+            no_files = 0;
+            break;
+        }
+    }
+    if(no_files) {
+        free(now);
+        return 0; // No changes to be committed
+    }
+
+    // Check if files marked as no change have been changed...
+    // ... and check if files marked as changed have been reverted
+    struct commit *prev = branch->head;
+    if(prev != NULL) {
+        // Update the hashes in parallel, skipping files that can't have
+        // changed since they were last hashed
+        size_t *jobs = malloc(sizeof(size_t) * (branch->n_files + 1));
+        if(jobs == NULL) {
+            exit(1); // An error has occurred
+        }
+        size_t n_jobs = 0;
+        for(size_t i = 0; i < branch->n_files; i++) {
+            char c = branch->files[i].change;
+            if((c == 'N' || c == 'M') && !not_in_workspace(&branch->files[i])
+            && (now[i].st_ino == 0
+            || !cache_matches(&branch->files[i].cache, &now[i]))) {
+                jobs[n_jobs++] = i;
+            }
+        }
+        struct hash_job_args args = {h, branch->files, jobs, NULL, NULL};
+        parallel_for(h, n_jobs, hash_job, &args);
+        free(jobs);
+
+        for(size_t i = 0; i < branch->n_files; i++) {
+            if(branch->files[i].change == 'N'
+            || branch->files[i].change == 'M') {
+                // Compare to previous commit's hash
+                struct tree_node *old = find_commit_file(h, prev,
+                                           branch->files[i].path);
+                if(old != NULL) {
+                    if(same_contents(old->hash, old->digest,
+                       branch->files[i].hash, branch->files[i].digest)) {
+                        branch->files[i].change = 'N';
+                        // The contents are the same as the committed blob
+                        branch->files[i].digest = old->digest;
+                    } else {
+                        branch->files[i].change = 'M';
+                    }
+                }
+            }
+        }
+    }
+
+    free(now);
+
+    // Check if there are any changes to commit
+    int changed = 0;
+    for(size_t i = 0; i < branch->n_files; i++) {
+        char c = branch->files[i].change;
+        // If change is not none and not awaiting addition, then it has changed
+        if(c != 'N' && c != 'a') {
+            changed = 1;
+            break;
+        }
+    }
+    if(!changed) {
+        return 0; // No changes to commit
+    }
+    // Otherwise there are changes
+    return 1;
+}
+
+// Helper function to set workspace to a given commit
+// Returns 0, or -1 if a file could not be restored, in which case the
+// workspace and branch are left as they were
+int set_to_commit(struct helper *helper, struct branch *from,
+                  struct branch *branch, struct commit *commit) {
+    if(commit == NULL) {
+        return 0;
+    }
+
+    // Copy the committed files that differ from the workspace, which holds
+    // from's tracked files. A file is already in place if from has the
+    // same contents and the file still has the signature it had when it
+    // was last hashed or written. Every file still being tracked names the
+    // blob holding its contents, so there is no need to look back through
+    // the history. A lazy checkout only records which blob each file
+    // needs, and leaves copying it to svc_hydrate
+    size_t count = 0;
+    struct tracked_file *files = commit_tracked_files(helper, commit, &count);
+    size_t *jobs = malloc(sizeof(size_t) * (count + 1));
+    int *results = malloc(sizeof(int) * (count + 1));
+    if(jobs == NULL || results == NULL) {
+        exit(1); // An error has occurred
+    }
+    size_t n_jobs = 0;
+    for(size_t i = 0; i < count; i++) {
+        if(not_in_workspace(&files[i])) {
+            files[i].cache.inode = 0;
+            continue; // Left out of the workspace
+        }
+        long pos = branch_find_path(from, files[i].path);
+        struct stat st;
+        if(pos >= 0 && from->files[pos].change == 'N' &&
+           files[i].digest != 0 && from->files[pos].digest == files[i].digest
+           && stat(files[i].path->name, &st) == 0 &&
+           file_unchanged(helper, &from->files[pos], &st)) {
+            files[i].cache = from->files[pos].cache;
+            continue; // Already in place
+        }
+        if(helper->lazy && files[i].digest != 0) {
+            // Leave it to svc_hydrate. From's version is taken away once
+            // the rest have been copied
+            files[i].lazy = 1;
+            files[i].cache.inode = 0;
+            continue;
+        }
+        jobs[n_jobs++] = i;
+    }
+    // Copy the rest in one batch, keeping the signature of each as it is
+    // written
+    restore_files(helper, files, jobs, n_jobs, results);
+    int ret = 0;
+    for(size_t i = 0; i < n_jobs; i++) {
+        if(results[i] != 0) {
+            ret = -1; // An error has occurred
+        }
+    }
+    if(ret != 0) {
+        // Put back from's version of each file already copied, so the
+        // workspace still holds from's tracked files
+        for(size_t i = 0; i < n_jobs; i++) {
+            if(results[i] != 0) {
+                continue; // Never written
+            }
+            long pos = branch_find_path(from, files[jobs[i]].path);
+            struct tracked_file *old = pos >= 0 ? &from->files[pos] : NULL;
+            if(old == NULL || old->lazy) {
+                unlink(files[jobs[i]].path->name); // From had no file here
+            } else if(old->digest == 0
+                      || restore_file(helper, old, &old->cache) != 0) {
+                old->cache.inode = 0; // Left to be hashed again
+            }
+        }
+        free(jobs);
+        free(results);
+        free(files);
+        return -1;
+    }
+    free(jobs);
+    free(results);
+
+    // Take away from's version of the files left to svc_hydrate
+    for(size_t i = 0; i < count; i++) {
+        if(files[i].lazy) {
+            long pos = branch_find_path(from, files[i].path);
+            if(pos >= 0 && !from->files[pos].lazy
+               && !not_in_workspace(&from->files[pos])) {
+                unlink(files[i].path->name);
+            }
+        }
+    }
+
+    // Remove the committed files that the commit does not track. Files
+    // changed since they were committed are left alone
+    for(size_t i = 0; i < from->n_files; i++) {
+        struct tracked_file *file = &from->files[i];
+        struct stat st;
+        if(file->change == 'N' && !not_in_workspace(file)
+           && tree_find(commit_tree(helper, commit), file->path) == NULL
+           && stat(file->path->name, &st) == 0 &&
+           file_unchanged(helper, file, &st)) {
+            unlink(file->path->name);
+        }
+    }
+
+    // Restore the commit's tracked files to the branch
+    branch_set_files(helper, branch, commit, files, count);
+    return 0;
+}
+
+// Helper function to set a branch's tracked files to those of a commit, as
+// made by commit_tracked_files. The branch takes ownership of files
+static void branch_set_files(struct helper *helper, struct branch *branch,
+                             struct commit *commit, struct tracked_file *files,
+                             size_t count) {
+    free(branch->files);
+    branch->files = files;
+    // Update the branch and current branch
+    branch->n_files = count;
+    branch->files_cap = count;
+    branch_index_rebuild(branch);
+    branch_set_head(helper, branch, commit);
+}
+
+// Helper function to list every file a commit tracks, in sorted order and
+// with no changes. Returns a new array, and sets count to its length
+static struct tracked_file *commit_tracked_files(struct helper *helper,
+                                                 struct commit *commit,
+                                                 size_t *count) {
+    struct tree_node *tree = commit_tree(helper, commit);
+    *count = tree_size(tree);
+    struct tracked_file *files = malloc(sizeof(struct tracked_file)
+                                        * (*count + 1));
+    if(files == NULL) {
+        exit(1); // An error has occurred
+    }
+    size_t index = 0;
+    tree_to_files(tree, files, &index);
+    return files;
+}
+
+// Helper function to read the changes of a commit that svc_open left in
+// the journal. Commits made since then already have them
+static void commit_read_files(struct helper *h, struct commit *commit) {
+    if(commit == NULL || !commit->unread) {
+        return; // Nothing to read
+    }
+    commit->unread = 0;
+    uint32_t len;
+    memcpy(&len, h->journal_map + commit->record + 1, sizeof(len));
+    struct byte_reader r = {h->journal_map + commit->record + 5, len, 0};
+    // Skip the id, branch, message and parents, which were read on opening
+    char id[7];
+    reader_bytes(&r, id, 7);
+    reader_u32(&r);
+    reader_span(&r, &len);
+    uint32_t n_parents = reader_u32(&r);
+    for(uint32_t i = 0; i < n_parents; i++) {
+        reader_u32(&r);
+    }
+    uint32_t n_files = reader_u32(&r);
+    if(r.error || n_files > r.left) {
+        return; // The record was checked when the journal was read
+    }
+    commit->files = arena_alloc(&h->arena,
+                                sizeof(struct tracked_file) * n_files);
+    for(uint32_t i = 0; i < n_files; i++) {
+        reader_file(h, &r, &commit->files[i], 0);
+        if(r.error) {
+            break;
+        }
+        commit->n_files++;
+    }
+}
+
+// Helper function to find the commit whose tree a commit's changes were
+// made on, or NULL if it was made on a branch with no head
+static struct commit *commit_base(struct commit *commit) {
+    if(commit->n_parents == 0 || commit->no_base) {
+        return NULL;
+    }
+    return commit->parents[0];
+}
+
+// Helper function to get the tree of a commit, which may be NULL. A commit
+// read back by svc_open has its tree built the first time it is needed:
+// from the nearest commit it was made from whose tree is known or listed
+// in the checkpoint, the changes of each commit after it are applied in
+// turn
+static struct tree_node *commit_tree(struct helper *h, struct commit *commit) {
+    size_t n = 0;
+    struct commit *known = commit;
+    while(known != NULL && !known->tree_ready && known->listing == 0) {
+        n++;
+        known = commit_base(known);
+    }
+    struct tree_node *tree = NULL;
+    if(known != NULL) {
+        if(!known->tree_ready) {
+            known->tree = tree_from_listing(h, known->listing);
+            known->tree_ready = 1;
+        }
+        tree = known->tree;
+    }
+    if(n == 0) {
+        return tree;
+    }
+    // The way back can be as long as the history, so it is not recursed
+    struct commit **chain = malloc(sizeof(struct commit *) * n);
+    if(chain == NULL) {
+        exit(1); // An error has occurred
+    }
+    struct commit *c = commit;
+    for(size_t i = n; i > 0; i--) {
+        chain[i - 1] = c;
+        c = commit_base(c);
+    }
+    for(size_t i = 0; i < n; i++) {
+        commit_read_files(h, chain[i]);
+        tree = tree_apply(h, tree, chain[i]);
+        chain[i]->tree = tree;
+        chain[i]->tree_ready = 1;
+    }
+    free(chain);
+    return tree;
+}
+
+// Helper function to copy a committed file's blob back into the workspace.
+// If cache is given, it is set to the signature of the restored file
+static int restore_file(struct helper *helper, struct tracked_file *file,
+                                               struct file_cache *cache) {
+    char *source = blob_path(helper, file->digest);
+    if(source == NULL) {
+        return -1; // An error has occurred
+    }
+    // Contents not stored in full are rebuilt from their delta
+    int ret = access(source, F_OK) == 0 ?
+              copy_file(source, file->path->name) :
+              restore_delta(helper, file->digest, file->path->name);
+    free(source);
+    if(cache != NULL) {
+        struct stat st;
+        if(ret == 0 && stat(file->path->name, &st) == 0) {
+            cache_from_stat(cache, &st);
+        } else {
+            cache->inode = 0;
+        }
+    }
+    return ret;
+}
+
+// Helper function to copy a file without going through a shell. The copy is
+// written next to the destination and renamed into place once complete, so
+// a failure never leaves a partially written file behind
+static int copy_file(char *source, char *dest) {
+    if(source == NULL || dest == NULL) {
+        return -1; // Defensive checks
+    }
+    int in = open(source, O_RDONLY);
+    if(in == -1) {
+        return -1; // Cannot open the source
+    }
+    struct stat st;
+    char *temp = NULL;
+    int out = fstat(in, &st) != 0 ? -1 :
+              open_temp(dest, st.st_mode & 0777, &temp);
+    if(out == -1) {
+        close(in);
+        return -1; // An error has occurred
+    }
+    int ret = copy_fd(in, out, st.st_size);
+    close(in);
+    // Move the finished copy into place
+    return finish_temp(out, temp, dest, ret);
+}
+
+// Helper function to create a temporary file next to dest, to be moved
+// over it by finish_temp. Returns its descriptor and sets temp to its name
+static int open_temp(char *dest, mode_t mode, char **temp) {
+    if(make_parent_dirs(dest) != 0) {
+        return -1; // An error has occurred
+    }
+    *temp = temp_path(dest);
+    if(*temp == NULL) {
+        return -1; // An error has occurred
+    }
+    int fd = open(*temp, O_WRONLY | O_CREAT | O_EXCL, mode);
+    if(fd == -1) {
+        free(*temp);
+        *temp = NULL;
+    }
+    return fd;
+}
+
+// Helper function to copy a batch of whole files on the thread pool, each
+// over its dest through a temporary file as copy_file does. Each job's
+// result is set, so failures are reported in the order the jobs were given
+// however the copies finished. Returns 0, or -1 if any copy failed
+static int copy_files(struct helper *helper, struct copy_job *jobs, size_t n) {
+    parallel_for(helper, n, copy_job_run, jobs);
+    int ret = 0;
+    for(size_t i = 0; i < n; i++) {
+        if(jobs[i].result != 0) {
+            ret = -1; // An error has occurred
+        }
+    }
+    return ret;
+}
+
+// Helper function to make one copy for copy_files on the thread pool
+static void copy_job_run(void *arg, size_t i) {
+    struct copy_job *job = &((struct copy_job *)arg)[i];
+    job->result = copy_file(job->source, job->dest);
+    if(job->cache != NULL) {
+        struct stat st;
+        if(job->result == 0 && stat(job->dest, &st) == 0) {
+            cache_from_stat(job->cache, &st);
+        } else {
+            job->cache->inode = 0;
+        }
+    }
+}
+
+// Helper function to copy files back from their blobs, setting each one's
+// signature and result. Contents stored in full are copied in one batch,
+// and the rest are rebuilt from their deltas in parallel
+static int restore_files(struct helper *helper, struct tracked_file *files,
+                         size_t *positions, size_t n, int *results) {
+    struct copy_job *copies = malloc(sizeof(struct copy_job) * (n + 1));
+    size_t *deltas = malloc(sizeof(size_t) * (n + 1));
+    int *delta_results = malloc(sizeof(int) * (n + 1));
+    if(copies == NULL || deltas == NULL || delta_results == NULL) {
+        exit(1); // An error has occurred
+    }
+    for(size_t i = 0; i < n; i++) {
+        struct tracked_file *file = &files[positions[i]];
+        copies[i].source = blob_path(helper, file->digest);
+        copies[i].dest = file->path->name;
+        copies[i].cache = &file->cache;
+        if(copies[i].source == NULL) {
+            exit(1); // An error has occurred
+        }
+    }
+    copy_files(helper, copies, n);
+    // A file whose full copy could not be read may be stored as a delta
+    size_t n_deltas = 0;
+    for(size_t i = 0; i < n; i++) {
+        results[i] = copies[i].result;
+        if(results[i] != 0) {
+            deltas[n_deltas++] = positions[i];
+        }
+        free(copies[i].source);
+    }
+    struct hash_job_args args = {helper, files, deltas, delta_results, NULL};
+    parallel_for(helper, n_deltas, restore_job, &args);
+    int ret = 0;
+    for(size_t i = 0, j = 0; i < n; i++) {
+        if(results[i] != 0) {
+            results[i] = delta_results[j++];
+        }
+        if(results[i] != 0) {
+            ret = -1; // An error has occurred
+        }
+    }
+    free(copies);
+    free(deltas);
+    free(delta_results);
+    return ret;
+}
+
+// Helper function to name a temporary file next to dest. Each copy gets
+// its own, since the same blob may be stored by two threads at once
+static char *temp_path(char *dest) {
+    static unsigned long copy_count = 0;
+    char suffix[64];
+    sprintf(suffix, ".svc_tmp.%ld.%lu", (long)getpid(),
+            __atomic_fetch_add(&copy_count, 1, __ATOMIC_RELAXED));
+    char *arr[] = {dest, suffix};
+    return str_concat(arr, 2);
+}
+
+// Helper function to close a file made by open_temp and move it over dest,
+// or remove it if ret shows writing it failed
+static int finish_temp(int fd, char *temp, char *dest, int ret) {
+    if(close(fd) != 0) {
+        ret = -1; // Data may not have been written
+    }
+    if(ret == 0 && rename(temp, dest) != 0) {
+        ret = -1;
+    }
+    if(ret != 0) {
+        unlink(temp);
+    }
+    free(temp);
+    return ret;
+}
+
+// Helper function to copy everything from one file descriptor to another
+static int copy_fd(int in, int out, off_t size) {
+#ifdef __linux__
+#ifdef FICLONE
+    // Share the source's blocks on file systems that support it, so the
+    // copy is made without writing any data
+    if(size > 0 && ioctl(out, FICLONE, in) == 0) {
+        return 0;
+    }
+#endif
+    // Let the kernel do the copy so the data never comes into user space
+    off_t left = size;
+    while(left > 0) {
+        ssize_t n = copy_file_range(in, NULL, out, NULL, left, 0);
+        if(n <= 0) {
+            break; // Not supported here, fall back
+        }
+        left -= n;
+    }
+    while(left > 0) {
+        ssize_t n = sendfile(out, in, NULL, left);
+        if(n <= 0) {
+            break; // Not supported here, fall back
+        }
+        left -= n;
+    }
+#else
+    (void)size;
+#endif
+    // Copy whatever is left with a buffered read/write loop
+    char *buff = malloc(HASH_BLOCK_SIZE);
+    if(buff == NULL) {
+        return -1; // An error has occurred
+    }
+    ssize_t n;
+    while((n = read(in, buff, HASH_BLOCK_SIZE)) != 0) {
+        if(n == -1) {
+            if(errno == EINTR) {
+                continue; // Interrupted, try again
+            }
+            free(buff);
+            return -1; // An error has occurred
+        }
+        // Write out the whole block
+        ssize_t done = 0;
+        while(done < n) {
+            ssize_t w = write(out, buff + done, n - done);
+            if(w == -1) {
+                if(errno == EINTR) {
+                    continue; // Interrupted, try again
+                }
+                free(buff);
+                return -1; // An error has occurred
+            }
+            done += w;
+        }
+    }
+    free(buff);
+    return 0;
+}
+
+// Helper function to create the directories leading up to a file
+static int make_parent_dirs(char *path) {
+    char *copy = malloc(sizeof(char) * (strlen(path) + 1));
+    if(copy == NULL) {
+        return -1; // An error has occurred
+    }
+    strcpy(copy, path);
+    // Make each directory in turn, skipping a leading '/'
+    for(char *p = copy + 1; *p != '\0'; p++) {
+        if(*p == '/') {
+            *p = '\0';
+            if(mkdir(copy, 0777) != 0 && errno != EEXIST) {
+                free(copy);
+                return -1; // An error has occurred
+            }
+            *p = '/';
+        }
+    }
+    free(copy);
+    return 0;
+}
+
+// Callback for remove_tree, called on each entry after its children
+static int remove_entry(const char *path, const struct stat *st, int type,
+                                                    struct FTW *ftw) {
+    (void)st;
+    (void)type;
+    (void)ftw;
+    return remove(path);
+}
+
+// Helper function to delete a directory and everything in it
+static int remove_tree(char *path) {
+    return nftw(path, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+// The journal is a header followed by records. Each record is a type byte,
+// a 32-bit payload length and the payload. Numbers are in native byte order
+// and strings are a 32-bit length followed by the bytes. Commits, branches
+// and files refer to each other by their position in the helper's lists.
+
+// Helper function to create the journal for a new repository
+static int journal_create(struct helper *helper) {
+    char *arr[] = {helper->dir, "/", JOURNAL_FILE};
+    char *path = str_concat(arr, 3);
+    if(path == NULL) {
+        return -1; // An error has occurred
+    }
+    helper->journal_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND,
+                                    0666);
+    free(path);
+    if(helper->journal_fd == -1) {
+        return -1; // An error has occurred
+    }
+    struct byte_buffer header = {NULL, 0, 0};
+    buffer_put(&header, JOURNAL_MAGIC, 4);
+    buffer_put_u32(&header, JOURNAL_VERSION);
+    int ret = write_all(helper->journal_fd, header.data, header.len);
+    free(header.data);
+    return ret;
+}
+
+// Open a repository that was closed with svc_close (or whose program
+// stopped without calling cleanup). path is the repository directory, for
+// example "svc_commits_a". Returns NULL if it cannot be opened
+void *svc_open(char *path) {
+    if(path == NULL) {
+        return NULL; // Defensive checks
+    }
+    char *arr[] = {path, "/", JOURNAL_FILE};
+    char *journal = str_concat(arr, 3);
+    if(journal == NULL) {
+        return NULL; // An error has occurred
+    }
+    int fd = open(journal, O_RDWR | O_APPEND);
+    free(journal);
+    if(fd == -1) {
+        return NULL; // Not a repository
+    }
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size < 8) {
+        close(fd);
+        return NULL; // Not a repository
+    }
+    // Map the journal so records are read straight from the page cache. It
+    // stays mapped, as older commits read their changes from it
+    unsigned char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(map == MAP_FAILED) {
+        close(fd);
+        return NULL; // An error has occurred
+    }
+    uint32_t version;
+    memcpy(&version, map + 4, sizeof(version));
+    if(memcmp(map, JOURNAL_MAGIC, 4) != 0 || version != JOURNAL_VERSION) {
+        munmap(map, st.st_size);
+        close(fd);
+        return NULL; // Not a journal this version understands
+    }
+
+    // Start from the checkpoint, and only read the records after it
+    struct helper *h = NULL;
+    size_t end = 0;
+    size_t checkpoint_len;
+    unsigned char *checkpoint = checkpoint_map(path, &checkpoint_len);
+    if(checkpoint != NULL) {
+        h = helper_new(path);
+        h->journal_map = map;
+        h->journal_map_len = st.st_size;
+        h->checkpoint_map = checkpoint;
+        h->checkpoint_len = checkpoint_len;
+        size_t start = checkpoint_load(h, checkpoint, checkpoint_len,
+                                       st.st_size);
+        end = start == 0 ? 0 : journal_replay(h, map, st.st_size, start);
+        if(end == 0) {
+            // It does not match the journal, so read the whole journal
+            h->journal_map = NULL;
+            free_helper(h);
+            h = NULL;
+        }
+    }
+    if(h == NULL) {
+        h = helper_new(path);
+        h->journal_map = map;
+        h->journal_map_len = st.st_size;
+        end = journal_replay(h, map, st.st_size, 8);
+    }
+    h->journal_fd = fd;
+    if(end == 0) {
+        free_helper(h);
+        return NULL; // The journal is corrupt
+    }
+    // Drop a record that was only partly written when the program stopped
+    if((off_t)end < st.st_size && ftruncate(fd, end) != 0) {
+        free_helper(h);
+        return NULL; // An error has occurred
+    }
+    return h;
+}
+
+// Helper function to bring the helper up to date with the records of a
+// journal from start on, which is just past the header or where the
+// checkpoint the helper was loaded from ends. Only the header of each
+// commit is read. Its changes are checked but left in the journal, and its
+// tree is built the first time it is needed, so opening costs time in
+// proportion to the records read rather than to the changes they made.
+// Returns where the last complete record ends, or 0 if a record is corrupt
+static size_t journal_replay(struct helper *h, unsigned char *map,
+                             size_t size, size_t start) {
+    // Count the commits first so the list is only grown once
+    size_t n_commits = h->n_commits;
+    size_t end = start;
+    madvise(map, size, MADV_SEQUENTIAL);
+    while(end + 5 <= size) {
+        uint32_t len;
+        memcpy(&len, map + end + 1, sizeof(len));
+        if(end + 5 + len > size) {
+            break; // Partly written record
+        }
+        if(map[end] == 'C') {
+            n_commits++;
+        }
+        end += 5 + len;
+    }
+    struct commit **temp = realloc(h->commits,
+                                   sizeof(struct commit *) * (n_commits + 1));
+    if(temp == NULL) {
+        exit(1); // An error has occurred
+    }
+    h->commits = temp;
+
+    size_t pos = start;
+    int ok = 1;
+    int pruned = 0;
+    while(ok && pos < end) {
+        char type = map[pos];
+        uint32_t len;
+        memcpy(&len, map + pos + 1, sizeof(len));
+        struct byte_reader r = {map + pos + 5, len, 0};
+        struct branch *branch = NULL;
+        if(type == 'C') {
+            struct commit *commit = journal_read_commit(h, &r);
+            if(commit == NULL) {
+                ok = 0;
+                break;
+            }
+            commit->seq = h->n_commits;
+            commit->record = pos;
+            // Changes were recorded in order, so the branch's head is still
+            // the commit they were made on
+            commit->no_base = commit->branch->head == NULL;
+            h->commits[h->n_commits++] = commit;
+            commit_index_insert(h, commit);
+            branch_set_head(h, commit->branch, commit);
+            branch = commit->branch;
+        } else if(type == 'B') {
+            ok = journal_read_branch(h, &r) == 0;
+        } else if(type == 'F') {
+            // Sparse patterns
+            uint32_t n = reader_u32(&r);
+            char **patterns = malloc(sizeof(char *) * ((size_t)n + 1));
+            if(r.error || n > r.left || patterns == NULL) {
+                free(patterns);
+                ok = 0;
+                break;
+            }
+            uint32_t n_read = 0;
+            while(n_read < n && !r.error) {
+                patterns[n_read] = reader_str(&r);
+                if(patterns[n_read] != NULL) {
+                    n_read++;
+                }
+            }
+            if(!r.error) {
+                sparse_set(h, patterns, n);
+            }
+            for(uint32_t i = 0; i < n_read; i++) {
+                free(patterns[i]);
+            }
+            free(patterns);
+        } else if(type == 'P') {
+            // Commits forgotten by garbage collection
+            uint32_t n = reader_u32(&r);
+            for(uint32_t i = 0; i < n && !r.error; i++) {
+                uint32_t c = reader_u32(&r);
+                if(c >= h->n_commits) {
+                    ok = 0;
+                    break;
+                }
+                h->commits[c]->pruned = 1;
+                pruned = 1;
+            }
+        } else if(type == 'H' || type == 'U' || type == 'S') {
+            uint32_t b = reader_u32(&r);
+            if(r.error || b >= h->n_branches) {
+                ok = 0;
+                break;
+            }
+            branch = h->branches[b];
+            if(type == 'H') {
+                int32_t c = (int32_t)reader_u32(&r);
+                if(c >= (int32_t)h->n_commits) {
+                    ok = 0;
+                    break;
+                }
+                branch_set_head(h, branch, c < 0 ? NULL : h->commits[c]);
+            } else if(type == 'U') {
+                h->current_branch = branch;
+                branch = NULL;
+            } else {
+                // Keep the latest saved tracked files of each branch
+                branch->stage = pos;
+                branch = NULL;
+            }
+        }
+        // Saved tracked files are out of date once the branch has moved
+        if(branch != NULL) {
+            branch->stage = 0;
+        }
+        ok = ok && !r.error;
+        pos += 5 + len;
+    }
+    // Older commits' changes are read from wherever they are needed
+    madvise(map, size, MADV_NORMAL);
+    // Forgotten commits can no longer be found by id
+    if(pruned) {
+        commit_index_rebuild(h);
+    }
+
+    // Set up each branch's tracked files
+    for(size_t i = 0; ok && i < h->n_branches; i++) {
+        struct branch *branch = h->branches[i];
+        if(branch->stage != 0) {
+            uint32_t len;
+            memcpy(&len, map + branch->stage + 1, sizeof(len));
+            struct byte_reader r = {map + branch->stage + 5, len, 0};
+            reader_u32(&r); // Skip the branch
+            ok = journal_read_stage(h, branch, &r) == 0;
+        } else if(branch->head != NULL) {
+            size_t count = 0;
+            struct tracked_file *files = commit_tracked_files(h, branch->head,
+                                                              &count);
+            branch_set_files(h, branch, branch->head, files, count);
+        }
+    }
+    return ok ? end : 0;
+}
+
+// Helper function to map a repository's checkpoint, setting len to its
+// size. Returns NULL if it has none
+static unsigned char *checkpoint_map(char *dir, size_t *len) {
+    char *arr[] = {dir, "/", CHECKPOINT_FILE};
+    char *path = str_concat(arr, 3);
+    if(path == NULL) {
+        return NULL; // An error has occurred
+    }
+    int fd = open(path, O_RDONLY);
+    free(path);
+    if(fd == -1) {
+        return NULL; // No checkpoint yet
+    }
+    struct stat st;
+    unsigned char *map = MAP_FAILED;
+    if(fstat(fd, &st) == 0 && st.st_size > 0) {
+        // Nearly all of it is read straight away
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE,
+                   fd, 0);
+    }
+    close(fd); // A mapping stays valid
+    if(map == MAP_FAILED) {
+        return NULL; // An error has occurred
+    }
+    *len = st.st_size;
+    return map;
+}
+
+// Helper function to set up a new helper from a checkpoint. Commits are
+// made from their entries without reading the journal, and messages are
+// used where they are in the map. Returns where in the journal the
+// checkpoint ends, or 0 if it is corrupt or the journal is shorter
+static size_t checkpoint_load(struct helper *h, unsigned char *map,
+                              size_t size, size_t journal_size) {
+    struct byte_reader r = {map, size, 0};
+    char magic[4];
+    reader_bytes(&r, magic, 4);
+    uint32_t version = reader_u32(&r);
+    uint64_t end = reader_u64(&r);
+    if(r.error || memcmp(magic, CHECKPOINT_MAGIC, 4) != 0
+       || version != CHECKPOINT_VERSION || end < 8 || end > journal_size) {
+        return 0; // Not a checkpoint of this journal
+    }
+    // Branches are written as their journal records are, and master is
+    // made by helper_new
+    uint32_t n_branches = reader_u32(&r);
+    if(r.error || n_branches == 0 || n_branches > r.left) {
+        return 0; // Corrupt checkpoint
+    }
+    for(uint32_t i = 1; i < n_branches; i++) {
+        if(journal_read_branch(h, &r) != 0) {
+            return 0; // Corrupt checkpoint
+        }
+    }
+    uint32_t current = reader_u32(&r);
+    if(r.error || current >= n_branches) {
+        return 0; // Corrupt checkpoint
+    }
+    h->current_branch = h->branches[current];
+    // Sparse patterns
+    uint32_t n_sparse = reader_u32(&r);
+    if(r.error || n_sparse > r.left) {
+        return 0; // Corrupt checkpoint
+    }
+    if(n_sparse > 0) {
+        char **patterns = malloc(sizeof(char *) * n_sparse);
+        if(patterns == NULL) {
+            exit(1); // An error has occurred
+        }
+        uint32_t n_read = 0;
+        while(n_read < n_sparse && !r.error) {
+            patterns[n_read] = reader_str(&r);
+            if(patterns[n_read] != NULL) {
+                n_read++;
+            }
+        }
+        if(!r.error) {
+            sparse_set(h, patterns, n_sparse);
+        }
+        for(uint32_t i = 0; i < n_read; i++) {
+            free(patterns[i]);
+        }
+        free(patterns);
+    }
+
+    // The commits, in the order they were made
+    uint32_t n_commits = reader_u32(&r);
+    if(r.error || n_commits > r.left) {
+        return 0; // Corrupt checkpoint
+    }
+    h->commits = malloc(sizeof(struct commit *) * ((size_t)n_commits + 1));
+    if(h->commits == NULL) {
+        exit(1); // An error has occurred
+    }
+    struct commit *commits = arena_alloc(&h->arena, sizeof(struct commit)
+                                                    * n_commits);
+    struct commit **parents = arena_alloc(&h->arena, sizeof(struct commit *)
+                                                     * 2 * n_commits);
+    for(uint32_t i = 0; i < n_commits; i++) {
+        struct commit *commit = &commits[i];
+        reader_bytes(&r, commit->id, 7);
+        commit->id[6] = '\0';
+        uint32_t b = reader_u32(&r);
+        uint32_t flags = reader_u32(&r);
+        uint32_t n_parents = reader_u32(&r);
+        if(r.error || b >= h->n_branches || n_parents > 2) {
+            return 0; // Corrupt checkpoint
+        }
+        commit->branch = h->branches[b];
+        commit->parents = NULL;
+        commit->n_parents = 0;
+        if(n_parents > 0) {
+            commit->parents = &parents[2 * (size_t)i];
+        }
+        for(uint32_t j = 0; j < n_parents; j++) {
+            uint32_t p = reader_u32(&r);
+            if(r.error || p >= i) {
+                return 0; // Corrupt checkpoint
+            }
+            commit->parents[commit->n_parents++] = h->commits[p];
+        }
+        commit->record = reader_u64(&r);
+        // Messages are followed by a '\0', so they are used in place
+        uint32_t len;
+        const char *message = reader_span(&r, &len);
+        char nul;
+        reader_bytes(&r, &nul, 1);
+        if(r.error || nul != '\0' || commit->record < 8
+           || commit->record >= end) {
+            return 0; // Corrupt checkpoint
+        }
+        commit->message = (char *)message;
+        commit->files = NULL;
+        commit->n_files = 0;
+        commit->tree = NULL;
+        commit->seq = i;
+        commit->generation = commit_generation(commit);
+        commit->pruned = flags & 1;
+        commit->heads = 0;
+        commit->reach = NULL;
+        commit->reach_words = 0;
+        commit->unread = 1;
+        commit->tree_ready = 0;
+        commit->no_base = (flags & 2) != 0;
+        commit->listed = 0;
+    commit->listing = 0;
+        h->commits[h->n_commits++] = commit;
+    }
+    // The id index is saved slot by slot, as placing a million commits
+    // again costs a cache miss each
+    uint64_t index_size = reader_u64(&r);
+    if(r.error || (index_size & (index_size - 1)) != 0
+       || index_size < h->n_commits || index_size > r.left / 4) {
+        return 0; // Corrupt checkpoint
+    }
+    if(index_size > 0) {
+        h->commit_index = malloc(sizeof(struct commit *) * index_size);
+        if(h->commit_index == NULL) {
+            exit(1); // An error has occurred
+        }
+    }
+    h->commit_index_size = index_size;
+    for(size_t i = 0; i < index_size; i++) {
+        uint32_t c;
+        memcpy(&c, r.p + i * 4, sizeof(c));
+        if(c > h->n_commits) {
+            return 0; // Corrupt checkpoint
+        }
+        h->commit_index[i] = c == 0 ? NULL : h->commits[c - 1];
+    }
+    r.p += index_size * 4;
+    r.left -= index_size * 4;
+
+    // Commits whose tracked files are listed, checked here so trees can be
+    // built from them when they are needed
+    uint32_t n_listed = reader_u32(&r);
+    if(r.error || n_listed > h->n_commits) {
+        return 0; // Corrupt checkpoint
+    }
+    for(uint32_t i = 0; i < n_listed; i++) {
+        uint32_t c = reader_u32(&r);
+        size_t listing = size - r.left;
+        reader_skip_files(&r, reader_u32(&r));
+        if(r.error || c >= h->n_commits) {
+            return 0; // Corrupt checkpoint
+        }
+        h->commits[c]->listed = 1;
+        h->commits[c]->listing = listing;
+    }
+
+    // Each branch's head, and where the journal last saved its tracked files
+    for(size_t i = 0; i < h->n_branches; i++) {
+        struct branch *branch = h->branches[i];
+        int32_t head = (int32_t)reader_u32(&r);
+        uint64_t stage = reader_u64(&r);
+        if(r.error || head >= (int32_t)h->n_commits || stage >= end
+           || (stage != 0 && stage < 8)) {
+            return 0; // Corrupt checkpoint
+        }
+        branch->stage = stage;
+        branch_set_head(h, branch, head < 0 ? NULL : h->commits[head]);
+    }
+    h->checkpoint_commits = h->n_commits;
+    return end;
+}
+
+// Helper function to check if enough has been committed since the last
+// checkpoint for another to be written
+static int checkpoint_due(struct helper *h) {
+    size_t made = h->n_commits - h->checkpoint_commits;
+    return made >= CHECKPOINT_INTERVAL && made >= h->checkpoint_commits / 8;
+}
+
+// Helper function to save the state the journal has reached, so that
+// svc_open can start from it rather than from the first record. Commits
+// only keep where their record is, and the tracked files of each branch
+// head are listed so that its tree is not built again from the whole
+// history. Returns 0, or -1 if it could not be written
+static int checkpoint_write(struct helper *h) {
+    // Everything the checkpoint covers must be in the journal first
+    if(h->journal_fd == -1 || fsync(h->journal_fd) != 0) {
+        return -1; // An error has occurred
+    }
+    off_t end = lseek(h->journal_fd, 0, SEEK_END);
+    if(end == -1) {
+        return -1; // An error has occurred
+    }
+    struct byte_buffer b = {NULL, 0, 0};
+    buffer_put(&b, CHECKPOINT_MAGIC, 4);
+    buffer_put_u32(&b, CHECKPOINT_VERSION);
+    buffer_put_u64(&b, (uint64_t)end);
+    buffer_put_u32(&b, h->n_branches);
+    for(size_t i = 1; i < h->n_branches; i++) {
+        // Heads are set once the commits are read
+        buffer_put_str(&b, h->branches[i]->branch_name);
+        buffer_put_u32(&b, (uint32_t)-1);
+    }
+    buffer_put_u32(&b, h->current_branch->seq);
+    buffer_put_u32(&b, h->n_sparse);
+    for(size_t i = 0; i < h->n_sparse; i++) {
+        buffer_put_str(&b, h->sparse[i]);
+    }
+    buffer_put_u32(&b, h->n_commits);
+    for(size_t i = 0; i < h->n_commits; i++) {
+        struct commit *commit = h->commits[i];
+        buffer_put(&b, commit->id, 7);
+        buffer_put_u32(&b, commit->branch->seq);
+        buffer_put_u32(&b, (commit->pruned ? 1 : 0) |
+                           (commit->no_base ? 2 : 0));
+        buffer_put_u32(&b, commit->n_parents);
+        for(size_t j = 0; j < commit->n_parents; j++) {
+            buffer_put_u32(&b, commit->parents[j]->seq);
+        }
+        buffer_put_u64(&b, commit->record);
+        buffer_put_str(&b, commit->message);
+        buffer_put(&b, "", 1);
+    }
+    // Then the id index, with each slot's commit as its position plus one
+    buffer_put_u64(&b, h->commit_index_size);
+    for(size_t i = 0; i < h->commit_index_size; i++) {
+        struct commit *commit = h->commit_index[i];
+        buffer_put_u32(&b, commit == NULL ? 0 : commit->seq + 1);
+    }
+    // List the tracked files of some commits, so that no tree is far from
+    // one it can be built from. Listed commits stay listed, and a new
+    // commit is listed once it is CHECKPOINT_SPACING commits from the
+    // nearest listed commit it was made from, and more commits than it has
+    // files. The number listed is filled in once they are written
+    size_t *since = malloc(sizeof(size_t) * (h->n_commits + 1));
+    if(since == NULL) {
+        exit(1); // An error has occurred
+    }
+    size_t count_pos = b.len;
+    uint32_t n_listed = 0;
+    buffer_put_u32(&b, 0);
+    for(size_t i = 0; i < h->n_commits; i++) {
+        struct commit *commit = h->commits[i];
+        struct commit *base = commit_base(commit);
+        since[i] = base == NULL ? 1 : since[base->seq] + 1;
+        if(!commit->listed && i >= h->checkpoint_commits
+           && since[i] >= CHECKPOINT_SPACING
+           && since[i] >= tree_size(commit_tree(h, commit))) {
+            commit->listed = 1;
+        }
+        if(!commit->listed) {
+            continue;
+        }
+        since[i] = 0;
+        n_listed++;
+        buffer_put_u32(&b, i);
+        if(commit->listing != 0) {
+            // Copy the list from the checkpoint it was read from
+            struct byte_reader list = {h->checkpoint_map + commit->listing,
+                                       h->checkpoint_len - commit->listing, 0};
+            reader_skip_files(&list, reader_u32(&list));
+            buffer_put(&b, h->checkpoint_map + commit->listing,
+                       h->checkpoint_len - commit->listing - list.left);
+            continue;
+        }
+        size_t count = 0;
+        struct tracked_file *files = commit_tracked_files(h, commit, &count);
+        buffer_put_u32(&b, count);
+        for(size_t j = 0; j < count; j++) {
+            buffer_put_file(&b, &files[j], 0);
+        }
+        free(files);
+    }
+    free(since);
+    memcpy(b.data + count_pos, &n_listed, sizeof(n_listed));
+    // Then each branch's head and where its tracked files were last saved
+    for(size_t i = 0; i < h->n_branches; i++) {
+        struct branch *branch = h->branches[i];
+        buffer_put_u32(&b, branch->head == NULL ? (uint32_t)-1
+                                                : branch->head->seq);
+        buffer_put_u64(&b, branch->stage);
+    }
+
+    // Replace the last checkpoint whole, so a reader never sees part of one
+    char *arr[] = {h->dir, "/", CHECKPOINT_FILE};
+    char *path = str_concat(arr, 3);
+    char *temp = NULL;
+    int fd = path == NULL ? -1 : open_temp(path, 0666, &temp);
+    int ret = -1;
+    if(fd != -1) {
+        ret = write_all(fd, b.data, b.len);
+        if(ret == 0 && fsync(fd) != 0) {
+            ret = -1; // An error has occurred
+        }
+        ret = finish_temp(fd, temp, path, ret);
+    }
+    free(path);
+    free(b.data);
+    if(ret == 0) {
+        h->checkpoint_commits = h->n_commits;
+    }
+    return ret;
+}
+
+// Helper function to append a record to the journal. If the write fails
+// the journal is cut back, so a later record never follows a broken one
+static int journal_append(struct helper *helper, char type,
+                                                struct byte_buffer *payload) {
+    if(helper->journal_fd == -1) {
+        return -1; // No journal
+    }
+    struct byte_buffer record = {NULL, 0, 0};
+    buffer_put(&record, &type, 1);
+    buffer_put_u32(&record, payload->len);
+    buffer_put(&record, payload->data, payload->len);
+    off_t start = lseek(helper->journal_fd, 0, SEEK_END);
+    int ret = write_all(helper->journal_fd, record.data, record.len);
+    if(ret != 0 && start != -1) {
+        if(ftruncate(helper->journal_fd, start) != 0) {
+            ret = -1; // Nothing more can be done
+        }
+    }
+    if(ret == 0) {
+        helper->journal_last = (size_t)start;
+    }
+    free(record.data);
+    free(payload->data);
+    return ret;
+}
+
+// Helper function to record a new commit
+static int journal_write_commit(struct helper *helper, struct commit *commit) {
+    struct byte_buffer b = {NULL, 0, 0};
+    buffer_put(&b, commit->id, 7);
+    buffer_put_u32(&b, commit->branch->seq);
+    buffer_put_str(&b, commit->message);
+    buffer_put_u32(&b, commit->n_parents);
+    for(size_t i = 0; i < commit->n_parents; i++) {
+        buffer_put_u32(&b, commit->parents[i]->seq);
+    }
+    buffer_put_u32(&b, commit->n_files);
+    for(size_t i = 0; i < commit->n_files; i++) {
+        buffer_put_file(&b, &commit->files[i], 0);
+    }
+    if(journal_append(helper, 'C', &b) != 0) {
+        return -1; // An error has occurred
+    }
+    // Checkpoints point back to the record, and the branch's saved tracked
+    // files are out of date once it moves
+    commit->record = helper->journal_last;
+    commit->branch->stage = 0;
+    return 0;
+}
+
+// Helper function to record a new branch
+static int journal_write_branch(struct helper *helper, struct branch *branch) {
+    struct byte_buffer b = {NULL, 0, 0};
+    buffer_put_str(&b, branch->branch_name);
+    buffer_put_u32(&b, branch->head == NULL ? (uint32_t)-1 : branch->head->seq);
+    return journal_append(helper, 'B', &b);
+}
+
+// Helper function to record that a branch's head has moved to a commit
+static int journal_write_head(struct helper *helper, struct branch *branch,
+                                                     struct commit *commit) {
+    struct byte_buffer b = {NULL, 0, 0};
+    buffer_put_u32(&b, branch->seq);
+    buffer_put_u32(&b, commit == NULL ? (uint32_t)-1 : commit->seq);
+    if(journal_append(helper, 'H', &b) != 0) {
+        return -1; // An error has occurred
+    }
+    branch->stage = 0;
+    return 0;
+}
+
+// Helper function to record commits that garbage collection has forgotten
+static int journal_write_prune(struct helper *helper, struct commit **commits,
+                                                      size_t n) {
+    struct byte_buffer b = {NULL, 0, 0};
+    buffer_put_u32(&b, n);
+    for(size_t i = 0; i < n; i++) {
+        buffer_put_u32(&b, commits[i]->seq);
+    }
+    return journal_append(helper, 'P', &b);
+}
+
+// Helper function to record the sparse patterns
+static int journal_write_sparse(struct helper *helper, char **patterns,
+                                size_t n) {
+    struct byte_buffer b = {NULL, 0, 0};
+    buffer_put_u32(&b, n);
+    for(size_t i = 0; i < n; i++) {
+        buffer_put_str(&b, patterns[i]);
+    }
+    return journal_append(helper, 'F', &b);
+}
+
+// Helper function to record which branch is checked out
+static int journal_write_current(struct helper *helper, struct branch *branch) {
+    struct byte_buffer b = {NULL, 0, 0};
+    buffer_put_u32(&b, branch->seq);
+    return journal_append(helper, 'U', &b);
+}
+
+// Helper function to save a branch's tracked files, including uncommitted
+// changes and the signatures that let unchanged files skip hashing
+static int journal_write_stage(struct helper *helper, struct branch *branch) {
+    struct byte_buffer b = {NULL, 0, 0};
+    buffer_put_u32(&b, branch->seq);
+    buffer_put_u32(&b, branch->n_files);
+    for(size_t i = 0; i < branch->n_files; i++) {
+        buffer_put_file(&b, &branch->files[i], 1);
+    }
+    if(journal_append(helper, 'S', &b) != 0) {
+        return -1; // An error has occurred
+    }
+    branch->stage = helper->journal_last;
+    return 0;
+}
+
+// Helper function to read a commit record. The commit is allocated in the
+// arena, so nothing needs freeing if the record turns out to be corrupt.
+// Its changes are checked but left in the record for commit_read_files
+static struct commit *journal_read_commit(struct helper *h,
+                                          struct byte_reader *r) {
+    struct commit *commit = arena_alloc(&h->arena, sizeof(struct commit));
+    commit->files = NULL;
+    commit->n_files = 0;
+    commit->tree = NULL;
+    commit->parents = NULL;
+    commit->n_parents = 0;
+    commit->pruned = 0;
+    commit->heads = 0;
+    commit->reach = NULL;
+    commit->reach_words = 0;
+    commit->unread = 1;
+    commit->tree_ready = 0;
+    commit->no_base = 0;
+    commit->record = 0;
+    commit->listed = 0;
+    commit->listing = 0;
+    reader_bytes(r, commit->id, 7);
+    commit->id[6] = '\0';
+    uint32_t b = reader_u32(r);
+    uint32_t len;
+    const char *message = reader_span(r, &len);
+    uint32_t n_parents = reader_u32(r);
+    if(r->error || b >= h->n_branches || n_parents > 2) {
+        return NULL; // Corrupt record
+    }
+    commit->message = arena_strdup(&h->arena, message, len);
+    commit->branch = h->branches[b];
+    if(n_parents > 0) {
+        commit->parents = arena_alloc(&h->arena, sizeof(struct commit *) * 2);
+    }
+    for(uint32_t i = 0; i < n_parents; i++) {
+        uint32_t p = reader_u32(r);
+        if(r->error || p >= h->n_commits) {
+            return NULL; // Corrupt record
+        }
+        commit->parents[commit->n_parents++] = h->commits[p];
+    }
+    commit->generation = commit_generation(commit);
+    reader_skip_files(r, reader_u32(r));
+    if(r->error) {
+        return NULL; // Corrupt record
+    }
+    return commit;
+}
+
+// Helper function to read a branch record
+static int journal_read_branch(struct helper *h, struct byte_reader *r) {
+    char *name = reader_str(r);
+    int32_t head = (int32_t)reader_u32(r);
+    if(r->error || head >= (int32_t)h->n_commits) {
+        free(name);
+        return -1; // Corrupt record
+    }
+    if(find_branch(h, name) != NULL) {
+        free(name);
+        return -1; // Corrupt record
+    }
+    struct branch *branch = malloc(sizeof(struct branch));
+    if(branch == NULL) {
         exit(1); // An error has occurred
     }
-    int count = 0;
-    for(size_t i = 0; i < branch->n_files; i++) {
-        if(arr[i] == 1) {
-            // Free name if marked for removal
-            free(branch->files[i].file_name);
-        } else {
-            // Copy to new list if not marked for removal
-            temp[count].file_name = branch->files[i].file_name;
-            temp[count].hash = branch->files[i].hash;
-            temp[count].change = branch->files[i].change;
-            count++;
+    branch->branch_name = name;
+    branch->head = NULL;
+    branch_set_head(h, branch, head < 0 ? NULL : h->commits[head]);
+    branch->files = NULL;
+    branch->n_files = 0;
+    branch->files_cap = 0;
+    branch->file_index = NULL;
+    branch->file_index_size = 0;
+    branch->seq = h->n_branches;
+    branch->stage = 0;
+    branch_register(h, branch);
+    return 0;
+}
+
+// Helper function to read a branch's saved tracked files
+static int journal_read_stage(struct helper *h, struct branch *branch,
+                                               struct byte_reader *r) {
+    uint32_t n_files = reader_u32(r);
+    if(r->error || n_files > r->left) {
+        return -1; // Corrupt record
+    }
+    if(branch_reserve(branch, n_files) != 0) {
+        exit(1); // An error has occurred
+    }
+    for(uint32_t i = 0; i < n_files; i++) {
+        reader_file(h, r, &branch->files[i], 1);
+        if(r->error) {
+            return -1; // Corrupt record
         }
+        branch_index_add(branch, i);
+        branch->n_files++;
     }
-    // Free the old list
-    free(branch->files);
-    // Update the branch to point to the new list
-    branch->files = temp;
-    branch->n_files = new_size;
+    return 0;
 }
 
-// Helper function to concatenate two or more strings
-char *str_concat(char ** arr, size_t n_strings) {
-    if(arr == NULL || n_strings == 0) {
-        return NULL; // An error has occurred
+// Helper function to add a tracked file to a record
+static void buffer_put_file(struct byte_buffer *b, struct tracked_file *file,
+                                                               int with_cache) {
+    buffer_put_u32(b, file->path->len);
+    buffer_put(b, file->path->name, file->path->len);
+    buffer_put_u32(b, (uint32_t)file->hash);
+    buffer_put(b, &file->change, 1);
+    buffer_put_u64(b, file->digest);
+    if(with_cache) {
+        buffer_put_u64(b, (uint64_t)file->cache.size);
+        buffer_put_u64(b, (uint64_t)file->cache.mtime_ns);
+        buffer_put_u64(b, (uint64_t)file->cache.ctime_ns);
+        buffer_put_u64(b, (uint64_t)file->cache.inode);
+        buffer_put(b, &file->lazy, 1);
     }
-    // Figure out how long the new string will be
-    size_t size = 0;
-    for(size_t i = 0; i < n_strings; i++) {
-        size += strlen(arr[i]);
+}
+
+// Helper function to read a tracked file from a record
+static void reader_file(struct helper *h, struct byte_reader *r,
+                        struct tracked_file *file, int with_cache) {
+    uint32_t len;
+    const char *name = reader_span(r, &len);
+    file->hash = (int)reader_u32(r);
+    reader_bytes(r, &file->change, 1);
+    file->digest = reader_u64(r);
+    file->cache.inode = 0;
+    file->lazy = 0;
+    if(with_cache) {
+        file->cache.size = (off_t)reader_u64(r);
+        file->cache.mtime_ns = (int64_t)reader_u64(r);
+        file->cache.ctime_ns = (int64_t)reader_u64(r);
+        file->cache.inode = (ino_t)reader_u64(r);
+        reader_bytes(r, &file->lazy, 1);
     }
-    // Allocate memory for the new string including null terminator
-    char *new_string = malloc(sizeof(char)*(size + 1));
-    if(new_string == NULL) {
-        return NULL; // An error has occurred
+    file->path = r->error ? NULL : intern_path(h, name, len);
+}
+
+// Helper function to pass over n tracked files of a record without
+// storing them, flagging an error if the record is too short
+static void reader_skip_files(struct byte_reader *r, uint32_t n) {
+    for(uint32_t i = 0; i < n && !r->error; i++) {
+        uint32_t len;
+        reader_span(r, &len);
+        unsigned char rest[13]; // Hash, change and digest
+        reader_bytes(r, rest, sizeof(rest));
     }
-    // Copy the old strings into the new one
-    int cur = 0;
-    for(size_t i = 0; i < n_strings; i++) {
-        for(size_t j = 0; j < strlen(arr[i]); j++) {
-            new_string[cur] = arr[i][j];
-            cur++;
+}
+
+// Helper function to add bytes to the end of a buffer
+static void buffer_put(struct byte_buffer *b, const void *data, size_t len) {
+    if(b->len + len > b->cap) {
+        size_t cap = b->cap == 0 ? 256 : b->cap * 2;
+        while(cap < b->len + len) {
+            cap *= 2;
+        }
+        unsigned char *temp = realloc(b->data, cap);
+        if(temp == NULL) {
+            exit(1); // An error has occurred
         }
+        b->data = temp;
+        b->cap = cap;
     }
-    // Add a null terminator
-    new_string[size] = '\0';
-    return new_string;
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
 }
 
-// Helper function to check for uncommitted changes
-int check_changes(struct helper *helper) {
-    struct helper *h = helper;
-    struct branch *branch = h->current_branch;
-    // If no files are currently being tracked...
-    if(branch->files == NULL) {
-        return 0; // ...nothing to commit
+static void buffer_put_u32(struct byte_buffer *b, uint32_t v) {
+    buffer_put(b, &v, sizeof(v));
+}
+
+static void buffer_put_u64(struct byte_buffer *b, uint64_t v) {
+    buffer_put(b, &v, sizeof(v));
+}
+
+static void buffer_put_str(struct byte_buffer *b, char *str) {
+    uint32_t len = strlen(str);
+    buffer_put_u32(b, len);
+    buffer_put(b, str, len);
+}
+
+// Helper function to add a number in 7 bit groups, lowest first, with the
+// top bit of each byte set if more follow
+static void buffer_put_varint(struct byte_buffer *b, uint64_t v) {
+    unsigned char bytes[10];
+    size_t n = 0;
+    while(v >= 0x80) {
+        bytes[n++] = (unsigned char)(v | 0x80);
+        v >>= 7;
     }
+    bytes[n++] = (unsigned char)v;
+    buffer_put(b, bytes, n);
+}
 
-    // Check if tracked files can still be accessed
-    // An array to mark files for removal
-    int *r_list = malloc(sizeof(int) * branch->n_files);
-    int r_count = 0;
-    for(size_t i = 0; i < branch->n_files; i++) {
-        r_list[i] = 0;
+// Helper function to take bytes from a record, flagging an error if the
+// record is too short
+static void reader_bytes(struct byte_reader *r, void *out, size_t len) {
+    if(r->error || len > r->left) {
+        r->error = 1;
+        memset(out, 0, len);
+        return;
     }
-    // Make sure files have not been deleted
-    for(size_t i = 0; i < branch->n_files; i++) {
-        if(branch->files[i].change == 'c') {
-            // File was previously awaiting addition but a commit is occurring
-            r_list[i] = 1; // ... mark it for removal
-            r_count++;
+    memcpy(out, r->p, len);
+    r->p += len;
+    r->left -= len;
+}
+
+static uint32_t reader_u32(struct byte_reader *r) {
+    uint32_t v;
+    reader_bytes(r, &v, sizeof(v));
+    return v;
+}
+
+static uint64_t reader_u64(struct byte_reader *r) {
+    uint64_t v;
+    reader_bytes(r, &v, sizeof(v));
+    return v;
+}
+
+// Helper function to read a number written by buffer_put_varint
+static uint64_t reader_varint(struct byte_reader *r) {
+    uint64_t v = 0;
+    for(int shift = 0; shift < 64; shift += 7) {
+        unsigned char byte;
+        reader_bytes(r, &byte, 1);
+        if(r->error) {
+            return 0;
         }
-        // If file is not already marked for delete, check if was deleted
-        if(branch->files[i].change != 'D'){
-            // If cannot access
-            if(access(branch->files[i].file_name, F_OK) == -1) {
-                // If the change was addition and now cannot be accessed...
-                if(branch->files[i].change == 'A'){
-                    // Mark it as awaiting addition
-                    branch->files[i].change = 'a';
-                } else {
-                    // Otherwise, mark it as pending deletion
-                    branch->files[i].change = 'd';
-                }
-            } else{
-                // If it can be accessed
-                // If change is awaiting addition
-                if(branch->files[i].change == 'a'){
-                    // It has now been added again
-                    branch->files[i].change = 'A';
-                } else if(branch->files[i].change == 'd') {
-                    // If it was pending deletion but can now be accessed...
-                    // ... set it to no change
-                    branch->files[i].change = 'N';
-                }
-            }
+        v |= (uint64_t)(byte & 0x7f) << shift;
+        if(!(byte & 0x80)) {
+            return v;
         }
     }
-    // Remove the files that were marked for removal
-    remove_tracked_files(branch, r_list, r_count);
-    free(r_list);
-    // Check if there are any files left, awaiting addition does not count
-    int no_files = 1;
-    for(size_t i = 0; i < branch->n_files; i++) {
-        if(branch->files[i].change != 'a') {
-            no_files = 0;
-            break;
-        }
+    r->error = 1; // Too long to be a number
+    return 0;
+}
+
+// Helper function to read a string into a new allocation
+static char *reader_str(struct byte_reader *r) {
+    uint32_t len;
+    const char *span = reader_span(r, &len);
+    if(span == NULL) {
+        return NULL;
     }
-    if(no_files) {
-        return 0; // No changes to be committed
+    char *str = malloc(sizeof(char) * (len + 1));
+    if(str == NULL) {
+        exit(1); // An error has occurred
     }
+    memcpy(str, span, len);
+    str[len] = '\0';
+    return str;
+}
 
-    // Check if files marked as no change have been changed...
-    // ... and check if files marked as changed have been reverted
-    struct commit *prev = branch->head;
-    if(prev != NULL) {
-        for(size_t i = 0; i < branch->n_files; i++) {
-            if(branch->files[i].change == 'N'
-            || branch->files[i].change == 'M') {
-                // Update the hash
-                branch->files[i].hash = hash_file(helper,
-                                        branch->files[i].file_name);
-                // Compare to previous commit's hash
-                for(size_t j = 0; j < prev->n_files; j++) {
-                    if(strcmp(prev->files[j].file_name,
-                              branch->files[i].file_name) == 0) {
-                        if(prev->files[j].hash == branch->files[i].hash) {
-                            branch->files[i].change = 'N';
-                        } else {
-                            branch->files[i].change = 'M';
-                        }
-                        break;
-                    }
-                }
+// Helper function to read a string without copying it. Returns where its
+// bytes are in the record, which are not followed by a '\0'
+static const char *reader_span(struct byte_reader *r, uint32_t *len) {
+    *len = reader_u32(r);
+    if(r->error || *len > r->left) {
+        r->error = 1;
+        return NULL;
+    }
+    const char *span = (const char *)r->p;
+    r->p += *len;
+    r->left -= *len;
+    return span;
+}
+
+// Helper function to write a whole buffer to a file descriptor
+static int write_all(int fd, const void *data, size_t len) {
+    const unsigned char *p = data;
+    while(len > 0) {
+        ssize_t n = write(fd, p, len);
+        if(n == -1) {
+            if(errno == EINTR) {
+                continue; // Interrupted, try again
             }
+            return -1; // An error has occurred
         }
+        p += n;
+        len -= n;
     }
+    return 0;
+}
 
-    // Check if there are any changes to commit
-    int changed = 0;
-    for(size_t i = 0; i < branch->n_files; i++) {
-        char c = branch->files[i].change;
-        // If change is not none and not awaiting addition, then it has changed
-        if(c != 'N' && c != 'a') {
-            changed = 1;
-            break;
+// Helper function to allocate memory that lasts until cleanup. Small
+// allocations are carved out of large blocks so that they cost no more than
+// moving a pointer, and are all freed together by arena_free
+static void *arena_alloc(struct arena *arena, size_t size) {
+    // Keep every allocation aligned for any type
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    struct arena_block *block = arena->blocks;
+    if(block == NULL || block->size - block->used < size) {
+        // Large allocations get a block of their own, so the current block
+        // can keep being used
+        size_t block_size = size > ARENA_BLOCK_SIZE / 4 ? size
+                                                        : ARENA_BLOCK_SIZE;
+        struct arena_block *temp = malloc(sizeof(struct arena_block)
+                                          + block_size);
+        if(temp == NULL) {
+            exit(1); // An error has occurred
         }
+#ifdef MADV_HUGEPAGE
+        // Fewer page faults for blocks as large as all the commits that
+        // svc_open makes at once, where the kernel allows
+        if(block_size >= MAP_HUGE_SIZE) {
+            size_t page = sysconf(_SC_PAGESIZE);
+            uintptr_t start = ((uintptr_t)temp + page - 1) & ~(page - 1);
+            uintptr_t end = ((uintptr_t)temp->data + block_size) & ~(page - 1);
+            madvise((void *)start, end - start, MADV_HUGEPAGE);
+        }
+#endif
+        temp->size = block_size;
+        temp->used = 0;
+        if(block_size != ARENA_BLOCK_SIZE && block != NULL) {
+            temp->next = block->next;
+            block->next = temp;
+        } else {
+            temp->next = block;
+            arena->blocks = temp;
+        }
+        arena->n_blocks++;
+        arena->reserved += block_size;
+        block = temp;
     }
-    if(!changed) {
-        return 0; // No changes to commit
+    void *ptr = block->data + block->used;
+    block->used += size;
+    arena->used += size;
+    arena->n_allocs++;
+    return ptr;
+}
+
+// Helper function to copy a string into the arena
+static char *arena_strdup(struct arena *arena, const char *str, size_t len) {
+    char *copy = arena_alloc(arena, len + 1);
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+// Helper function to free everything allocated from an arena
+static void arena_free(struct arena *arena) {
+    struct arena_block *block = arena->blocks;
+    while(block != NULL) {
+        struct arena_block *next = block->next;
+        free(block);
+        block = next;
     }
-    // Otherwise there are changes
-    return 1;
+    memset(arena, 0, sizeof(struct arena));
 }
 
-// Helper function to set workspace to a given commit
-void set_to_commit(struct helper *helper, struct branch *branch,
-                                          struct commit *commit) {
-    if(commit == NULL) {
-        return;
+// Helper function to hash len bytes of a name. Gives the same hash as
+// string_hash, but the name need not end in a '\0'
+static size_t string_hash_len(const char *str, size_t len) {
+    size_t hash = 2166136261u;
+    for(size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)str[i];
+        hash *= 16777619u;
     }
+    return hash;
+}
 
-    // Copy the committed files into the workspace
-    for(size_t i = 0; i < commit->n_files; i++) {
-        // If change was a modification or addition, then restore from commit
-        if(commit->files[i].change == 'M' || commit->files[i].change == 'A') {
-
-            char *arr[] = {"cp ", helper->dir, "/", commit->id, "/\"",
-                                  commit->files[i].file_name, "\" \"",
-                                    commit->files[i].file_name, "\""};
-            char *command = str_concat(arr, 9);
-            if(command == NULL) {
-                return; // An error has occurred
-            }
-            if(system(command) != 0) {
-                return; // An error has occurred
-            }
-            free(command);
-        }
-        // If change was none, then look for previous commit to retore from
-        if(commit->files[i].change == 'N') {
-            // Due to the way the svc is designed, a file that has no change...
-            // ... recorded will have a change or addition recorded at some ...
-            // ... point in the direct history of the commit, even ...
-            // ... accounting for merges and branches
-            struct commit *prev;
-            if(commit->parents == NULL) {
-                prev = NULL;
-            } else {
-                prev = commit->parents[0];
-            }
-            int found = 0;
-            // Keep looking while there is a previous parent and haven't found
-            while(prev != NULL && !found) {
-                for(size_t j = 0; j < prev->n_files; j++) {
-                    if(strcmp(commit->files[i].file_name,
-                                prev->files[j].file_name) == 0) {
-                        // Found the file in a previous commit
-                        // Check if a change was recorded for the file
-                        char change = prev->files[j].change;
-                        if(change == 'A' || change == 'M') {
-                            // If an addition or modification was recorded,
-                            // then a copy was stored. Restore the copy
-                            char *arr[] = {"cp ", helper->dir, "/", prev->id,
-                                            "/\"", prev->files[j].file_name,
-                                    "\" \"", prev->files[j].file_name, "\""};
-                            char *command = str_concat(arr, 9);
-                            if(command == NULL) {
-                                return; // An error has occurred
-                            }
-                            if(system(command) != 0) {
-                                return; // An error has occurred
-                            }
-                            free(command);
-                            found = 1; // Break out of the loop
-                            break;
-                        }
-                    }
-                }
-                // Set prev to next
-                if(prev->parents == NULL) {
-                    prev = NULL;
-                } else {
-                    prev = prev->parents[0];
+// Helper function to find the stored path with a name, or NULL if no file
+// with that name has ever been tracked
+static struct path *find_path(struct helper *helper, const char *name) {
+    return lookup_path(helper, name, strlen(name), NULL);
+}
+
+// Helper function to look for a path in the path table. If slot is given it
+// gets the slot where the path belongs when it is not found
+static struct path *lookup_path(struct helper *helper, const char *name,
+                                size_t len, size_t *slot) {
+    struct path_table *t = &helper->paths;
+    if(t->size == 0) {
+        return NULL; // Nothing stored yet
+    }
+    size_t mask = t->size - 1;
+    size_t i = string_hash_len(name, len) & mask;
+    while(t->slots[i] != NULL) {
+        struct path *path = t->slots[i];
+        if(path->len == len && memcmp(path->name, name, len) == 0) {
+            return path; // Already stored
+        }
+        i = (i + 1) & mask;
+    }
+    if(slot != NULL) {
+        *slot = i;
+    }
+    return NULL;
+}
+
+// Helper function to find the single copy of a path, adding it to the arena
+// if it is new. Every tracked file list shares these, so a name is stored
+// once however many branches and commits track it, and two files have the
+// same name exactly when they have the same path
+static struct path *intern_path(struct helper *helper, const char *name,
+                                size_t len) {
+    struct path_table *t = &helper->paths;
+    // Keep the table at most half full
+    if((t->n_paths + 1) * 2 > t->size) {
+        size_t size = t->size == 0 ? 1024 : t->size * 2;
+        struct path **slots = calloc(size, sizeof(struct path *));
+        struct path **paths = realloc(t->paths, sizeof(struct path *)
+                                                * size / 2);
+        if(slots == NULL || paths == NULL) {
+            exit(1); // An error has occurred
+        }
+        for(size_t i = 0; i < t->size; i++) {
+            if(t->slots[i] != NULL) {
+                size_t j = string_hash_len(t->slots[i]->name,
+                                           t->slots[i]->len) & (size - 1);
+                while(slots[j] != NULL) {
+                    j = (j + 1) & (size - 1);
                 }
+                slots[j] = t->slots[i];
             }
         }
+        free(t->slots);
+        t->slots = slots;
+        t->paths = paths;
+        t->size = size;
     }
-
-    // Restore the commit's tracked files to the branch
-    int count = 0;
-    for(size_t i = 0; i < commit->n_files; i++) {
-        // Count number of files that were not removed after this commit
-        if(commit->files[i].change != 'D') {
-            count++;
+    size_t slot;
+    struct path *path = lookup_path(helper, name, len, &slot);
+    if(path != NULL) {
+        return path;
+    }
+    // Store the name followed by its sort key
+    path = arena_alloc(&helper->arena, sizeof(struct path) + len * 2 + 1);
+    path->id = t->n_paths;
+    path->len = len;
+    memcpy(path->name, name, len);
+    path->name[len] = '\0';
+    path->key = (unsigned char *)path->name + len + 1;
+    path->in_sparse = sparse_matches(helper, path->name);
+    for(size_t i = 0; i < len; i++) {
+        int c = name[i];
+        // Convert to lower case
+        if(c >= 65 && c <= 90) {
+            c += 32;
         }
+        // Names were compared as signed chars, so flip the top bit to give
+        // the same order when compared as unsigned bytes
+        path->key[i] = (unsigned char)c ^ 0x80;
     }
-    // Free the current files
-    for(size_t i = 0; i < branch->n_files; i++) {
-        free(branch->files[i].file_name);
+    t->slots[slot] = path;
+    t->paths[t->n_paths++] = path;
+    return path;
+}
+
+// Report how much memory the repository is using for commits, their
+// tracked file lists and path names
+int svc_memory_stats(void *helper, struct svc_memory_stats *stats) {
+    if(helper == NULL || stats == NULL) {
+        return -1; // Defensive checks
     }
-    struct tracked_file *temp = realloc(branch->files,
-                                sizeof(struct tracked_file) * count);
-    if(temp == NULL) {
-        return; // An error has occurred
+    struct helper *h = (struct helper *)helper;
+    stats->arena_blocks = h->arena.n_blocks;
+    stats->arena_reserved = h->arena.reserved;
+    stats->arena_used = h->arena.used;
+    stats->arena_allocations = h->arena.n_allocs;
+    stats->n_paths = h->paths.n_paths;
+    stats->path_table_bytes = h->paths.size * sizeof(struct path *) * 3 / 2;
+    stats->n_commits = h->n_commits;
+    // Branch file lists are the only per-file memory outside the arena
+    stats->branch_bytes = 0;
+    for(size_t i = 0; i < h->n_branches; i++) {
+        stats->branch_bytes += h->branches[i]->files_cap
+                               * sizeof(struct tracked_file)
+                               + h->branches[i]->file_index_size
+                               * sizeof(size_t);
     }
-    branch->files = temp;
-    // Copy the files over
-    int index = 0; // Track index of files being copied
+    // The bitmaps of what their heads reach, shared by branches at one head
+    stats->branch_bytes += h->reach_words * sizeof(uint64_t);
+    // The branch lists and name index
+    stats->branch_bytes += h->n_branches * sizeof(struct branch *) * 2
+                           + h->branch_index_size * sizeof(struct branch *);
+    return 0;
+}
+
+// Each commit's tracked files are kept in a treap ordered by path, which
+// shares every node it did not change with the tree it was made from. A
+// node's priority comes from its path, so a set of files always gives the
+// same shape and a path is found in O(log n) steps. Nodes made while
+// applying one commit's changes belong to that edit and are changed in
+// place, the rest are copied, so a commit costs O(k log n) new nodes for k
+// changes however many files are tracked
+
+// Helper function to make the tree of a commit from the tree it was made on
+// and the commit's changes
+static struct tree_node *tree_apply(struct helper *h, struct tree_node *root,
+                                                      struct commit *commit) {
+    uint32_t gen = ++h->tree_gen;
     for(size_t i = 0; i < commit->n_files; i++) {
-        if(commit->files[i].change != 'D') {
-            // Copy the name
-            char *temp_str = malloc(sizeof(char) *
-                                    (strlen(commit->files[i].file_name) + 1));
-            if(temp_str == NULL) {
-                return; // An error has occurred
-            }
-            branch->files[index].file_name = temp_str;
-            strcpy(branch->files[index].file_name, commit->files[i].file_name);
-            // Copy the hash
-            branch->files[index].hash = commit->files[i].hash;
-            // Set change to none, since no changes after a commit
-            branch->files[index].change = 'N';
-            index++;
+        struct tracked_file *file = &commit->files[i];
+        if(file->change == 'D') {
+            root = tree_remove(h, gen, root, file->path);
+        } else {
+            root = tree_insert(h, gen, root, file);
         }
     }
-    // Update the branch and current branch
-    branch->n_files = count;
-    branch->head = commit;
+    return root;
+}
+
+// Helper function to make a tree from the tracked files listed at pos in
+// the checkpoint
+static struct tree_node *tree_from_listing(struct helper *h, size_t pos) {
+    uint32_t gen = ++h->tree_gen;
+    struct byte_reader r = {h->checkpoint_map + pos, h->checkpoint_len - pos,
+                            0};
+    uint32_t n = reader_u32(&r);
+    struct tree_node *root = NULL;
+    for(uint32_t i = 0; i < n && !r.error; i++) {
+        struct tracked_file file;
+        reader_file(h, &r, &file, 0);
+        if(!r.error) {
+            root = tree_insert(h, gen, root, &file);
+        }
+    }
+    return root;
+}
+
+// Helper function to get a node that the edit gen may change, copying it
+// if it is shared with an earlier tree
+static struct tree_node *tree_own(struct helper *h, uint32_t gen,
+                                                   struct tree_node *node) {
+    if(node->gen == gen) {
+        return node; // Made by this edit
+    }
+    struct tree_node *copy = arena_alloc(&h->arena, sizeof(struct tree_node));
+    *copy = *node;
+    copy->gen = gen;
+    return copy;
+}
+
+// Helper function to find how many files are in a tree
+static size_t tree_size(struct tree_node *node) {
+    return node == NULL ? 0 : node->size;
+}
+
+// Helper function to recount a node's files after its children change
+static void tree_update(struct tree_node *node) {
+    node->size = 1 + tree_size(node->left) + tree_size(node->right);
+}
+
+// Helper function to give each path a well mixed priority
+static uint64_t tree_priority(struct path *path) {
+    uint64_t x = path->id + 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+// Helper function to order paths in a tree. Paths that only differ in case
+// are ordered by id, so no two paths are equal
+static int tree_compare(struct path *a, struct path *b) {
+    int ret = path_compare(a, b);
+    if(ret == 0 && a != b) {
+        ret = a->id < b->id ? -1 : 1;
+    }
+    return ret;
+}
+
+// Helper function to add a file to a tree, or update it if it is there
+static struct tree_node *tree_insert(struct helper *h, uint32_t gen,
+                                     struct tree_node *node,
+                                     struct tracked_file *file) {
+    if(node != NULL && node->path == file->path) {
+        // Already tracked, so update it
+        node = tree_own(h, gen, node);
+        node->hash = file->hash;
+        node->digest = file->digest;
+        return node;
+    }
+    if(node == NULL || tree_priority(file->path) > tree_priority(node->path)) {
+        // The file belongs here. Every node above a path has a higher
+        // priority, so the path cannot be further down
+        struct tree_node *new_node = arena_alloc(&h->arena,
+                                                 sizeof(struct tree_node));
+        new_node->path = file->path;
+        new_node->hash = file->hash;
+        new_node->digest = file->digest;
+        new_node->gen = gen;
+        tree_split(h, gen, node, file->path, &new_node->left,
+                                             &new_node->right);
+        tree_update(new_node);
+        return new_node;
+    }
+    node = tree_own(h, gen, node);
+    if(tree_compare(file->path, node->path) < 0) {
+        node->left = tree_insert(h, gen, node->left, file);
+    } else {
+        node->right = tree_insert(h, gen, node->right, file);
+    }
+    tree_update(node);
+    return node;
+}
+
+// Helper function to split a tree into the paths before a path and the
+// paths after it
+static void tree_split(struct helper *h, uint32_t gen, struct tree_node *node,
+                       struct path *path, struct tree_node **left,
+                       struct tree_node **right) {
+    if(node == NULL) {
+        *left = NULL;
+        *right = NULL;
+        return;
+    }
+    node = tree_own(h, gen, node);
+    if(tree_compare(node->path, path) < 0) {
+        tree_split(h, gen, node->right, path, &node->right, right);
+        *left = node;
+    } else {
+        tree_split(h, gen, node->left, path, left, &node->left);
+        *right = node;
+    }
+    tree_update(node);
+}
+
+// Helper function to remove a path from a tree. A tree without the path is
+// returned unchanged
+static struct tree_node *tree_remove(struct helper *h, uint32_t gen,
+                                     struct tree_node *node,
+                                     struct path *path) {
+    if(node == NULL) {
+        return NULL; // Not tracked
+    }
+    if(node->path == path) {
+        return tree_join(h, gen, node->left, node->right);
+    }
+    int left = tree_compare(path, node->path) < 0;
+    struct tree_node *child = left ? node->left : node->right;
+    // Nodes made by this edit are changed in place, so compare sizes to see
+    // if anything was removed
+    size_t before = tree_size(child);
+    struct tree_node *updated = tree_remove(h, gen, child, path);
+    if(tree_size(updated) == before) {
+        return node; // Nothing was removed
+    }
+    node = tree_own(h, gen, node);
+    if(left) {
+        node->left = updated;
+    } else {
+        node->right = updated;
+    }
+    tree_update(node);
+    return node;
+}
+
+// Helper function to join two trees where every path in left comes before
+// every path in right
+static struct tree_node *tree_join(struct helper *h, uint32_t gen,
+                                   struct tree_node *left,
+                                   struct tree_node *right) {
+    if(left == NULL) {
+        return right;
+    }
+    if(right == NULL) {
+        return left;
+    }
+    if(tree_priority(left->path) > tree_priority(right->path)) {
+        left = tree_own(h, gen, left);
+        left->right = tree_join(h, gen, left->right, right);
+        tree_update(left);
+        return left;
+    }
+    right = tree_own(h, gen, right);
+    right->left = tree_join(h, gen, left, right->left);
+    tree_update(right);
+    return right;
+}
+
+// Helper function to find a path in a tree
+static struct tree_node *tree_find(struct tree_node *node, struct path *path) {
+    while(node != NULL && node->path != path) {
+        node = tree_compare(path, node->path) < 0 ? node->left : node->right;
+    }
+    return node;
+}
+
+// Helper function to copy a tree's files in order into files, starting at
+// index, as unchanged files in the workspace with nothing cached
+static void tree_to_files(struct tree_node *node, struct tracked_file *files,
+                                                  size_t *index) {
+    while(node != NULL) {
+        tree_to_files(node->left, files, index);
+        struct tracked_file *file = &files[(*index)++];
+        file->path = node->path;
+        file->hash = node->hash;
+        file->digest = node->digest;
+        file->change = 'N';
+        file->cache.inode = 0;
+        file->lazy = 0;
+        // Loop on the right rather than recursing
+        node = node->right;
+    }
 }
@@ -2,14 +2,148 @@
 #define svc_h
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+// Directory inside the repository where file contents are stored by digest
+#define OBJECTS_DIR "objects"
+
+// A changed file may instead be stored as a delta against a full copy of an
+// earlier version, in a file named by its digest followed by DELTA_SUFFIX
+#define DELTA_SUFFIX ".d"
+#define DELTA_MAGIC "SVCD"
+#define DELTA_BLOCK 32 // Shortest run of bytes copied from the base
+#define DELTA_MAX_SIZE (64<<20) // Larger files and bases are stored in full
+#define DELTA_COMPRESSED 1 // Set when the instructions are compressed
+
+// zstd level for delta instructions when built with SVC_USE_ZSTD
+#define SVC_COMPRESS_LEVEL 3
+
+// Size of the blocks that commits and path names are allocated from
+#define ARENA_BLOCK_SIZE (1<<20)
+#define ARENA_ALIGN 16
+
+// File inside the repository recording its commits and branches
+#define JOURNAL_FILE "journal"
+#define JOURNAL_MAGIC "SVCJ"
+#define JOURNAL_VERSION 3
+
+// File inside the repository holding the state the journal had reached, so
+// that opening only reads the records written after it
+#define CHECKPOINT_FILE "checkpoint"
+#define CHECKPOINT_MAGIC "SVCK"
+#define CHECKPOINT_VERSION 1
+// Fewest commits made since the last checkpoint before another is written.
+// Once the history is longer it waits for an eighth of the history, so the
+// cost of writing them stays in proportion to the commits made
+#define CHECKPOINT_INTERVAL 4096
+// Checkpoints list the tracked files of commits this many apart, or as far
+// apart as they have files if that is more, so that a commit's tree is
+// never built by applying more commits' changes than that
+#define CHECKPOINT_SPACING 4096
+
+// A block of memory that the arena hands out in pieces
+struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+    _Alignas(ARENA_ALIGN) unsigned char data[];
+};
+
+// Memory that lasts as long as the repository. Commits, their tracked file
+// lists and path names are allocated here and freed all at once
+struct arena {
+    struct arena_block *blocks; // The first block is the one being filled
+    size_t n_blocks;
+    size_t reserved; // Bytes taken from malloc
+    size_t used; // Bytes handed out
+    size_t n_allocs;
+};
+
+// A file name, stored once for the whole repository
+struct path {
+    uint32_t id; // Position in the path table's list of paths
+    uint32_t len;
+    unsigned char *key; // Lower case name, for sorting with memcmp
+    int in_sparse; // Set if the sparse patterns keep it in the workspace
+    char name[];
+};
+
+// Open addressing table holding the single copy of each path
+struct path_table {
+    struct path **slots;
+    size_t size; // Number of slots, always a power of two
+    struct path **paths; // Paths by id
+    size_t n_paths;
+};
+
+// Memory used by a repository, as reported by svc_memory_stats
+struct svc_memory_stats {
+    size_t arena_blocks;
+    size_t arena_reserved;
+    size_t arena_used;
+    size_t arena_allocations;
+    size_t n_paths;
+    size_t path_table_bytes;
+    size_t n_commits;
+    size_t branch_bytes; // Tracked file lists and indexes of branches
+};
+
+// A set of digests, open addressing with 0 marking an empty slot
+struct digest_set {
+    uint64_t *slots;
+    size_t size; // Number of slots, always a power of two
+    size_t n;
+};
+
+// Garbage collection that removes stored objects no branch can reach. The
+// objects directory is swept on a thread of its own
+struct gc_state {
+    pthread_t thread;
+    int running; // A sweep was started and has not been waited for
+    pthread_mutex_t lock; // Held while an object is removed
+    pthread_cond_t wake; // Signalled to stop a sweep that is waiting
+    int stop;
+    struct digest_set live; // Objects reachable when the sweep started
+    struct digest_set kept; // Objects used by commits since then
+    size_t bytes_per_sec; // Most bytes removed each second, 0 for no limit
+    size_t removed; // Objects removed so far
+};
 
 struct helper {
     char * dir;
     struct commit **commits;
     size_t n_commits;
-    struct branch **branches;
+    struct commit **commit_index; // Open addressing table of commits by id
+    size_t commit_index_size; // Number of slots, always a power of two
+    struct branch **branches; // In the order they were created
     size_t n_branches;
+    struct branch **branch_index; // Open addressing table of branches by name
+    size_t branch_index_size; // Number of slots, always a power of two
+    struct branch **sorted_branches; // Sorted by name for prefix listing
     struct branch *current_branch;
+    size_t reach_words; // Total size of the commits' reach bitmaps
+    int strong_hash; // Non-zero to keep a 64-bit digest of each tracked file
+    int n_threads; // Threads used to hash and copy files, 0 for one per CPU
+    struct thread_pool *pool; // Started the first time it is needed
+    int journal_fd; // Journal records are appended here
+    struct arena arena; // Commits and path names
+    struct path_table paths;
+    uint32_t tree_gen; // Counts edits made to commit trees
+    int compress_level; // zstd level for deltas, 0 to leave them as they are
+    struct gc_state gc;
+    char **sparse; // Patterns of the files kept in the workspace
+    size_t n_sparse; // 0 to keep every file
+    int lazy; // Set to leave checked out files to svc_hydrate
+    unsigned char *journal_map; // The journal as it was opened, which the
+                                // changes of older commits are read from
+    size_t journal_map_len;
+    unsigned char *checkpoint_map; // The checkpoint it was opened from
+    size_t checkpoint_len;
+    size_t checkpoint_commits; // Commits in the last checkpoint read or written
+    size_t journal_last; // Where the last record appended starts
 };
 
 struct branch {
@@ -17,22 +151,99 @@ struct branch {
     struct commit *head;
     struct tracked_file *files;
     size_t n_files;
+    size_t files_cap; // Room in files before it must grow
+    size_t *file_index; // Open addressing table of file positions plus one
+    size_t file_index_size; // Number of slots, always a power of two
+    size_t seq; // Position in the helper's list of branches
+    size_t stage; // Where the journal saved its tracked files, 0 if out of
+                  // date
 };
 
 struct commit {
     char id[7];
-    struct tracked_file *files;
+    struct tracked_file *files; // Files changed by this commit, sorted
     size_t n_files;
+    struct tree_node *tree; // Every file tracked by this commit, once
+                            // tree_ready is set
     struct branch *branch;
     char *message;
     struct commit **parents;
     size_t n_parents;
+    size_t seq; // Position in the helper's list of commits
+    size_t generation; // 1 plus the highest generation of the parents
+    int pruned; // No branch reaches it, so its files may have been removed
+    size_t heads; // Number of branches this is the head of
+    // Bit per commit reachable from here, shared by the branches this is the
+    // head of. NULL until needed, and freed once it is no branch's head
+    uint64_t *reach;
+    size_t reach_words;
+    // Commits read back by svc_open leave their changes in the journal and
+    // build their tree the first time it is needed
+    int unread; // Set until files is read from the journal
+    int tree_ready;
+    int no_base; // Made on a branch with no head, so its tree does not
+                 // start from its first parent's
+    size_t record; // Where its record starts in the journal
+    int listed; // Its tracked files are listed in every checkpoint
+    size_t listing; // Where they are in the checkpoint it was read from, 0
+                    // if they are not there
+};
+
+// Commits waiting to be visited, highest generation first
+struct commit_heap {
+    struct commit **commits;
+    size_t n;
+    size_t cap;
+    int by_seq; // Newest first instead, ignoring generation
+};
+
+// Orders and options for svc_log_open
+#define SVC_LOG_DATE 0
+#define SVC_LOG_TOPO 1
+#define SVC_LOG_FIRST_PARENT 2
+
+// A walk through the history of a commit
+struct svc_log {
+    struct helper *helper;
+    struct commit_heap heap; // Commits waiting to be visited
+    uint64_t *seen; // Bit per commit already queued, NULL for first parents
+    struct path *path; // Only commits changing this file, NULL for all
+    int flags;
+    int done; // Set when nothing can come out
+};
+
+// How far behind the clock a file's times must be before its signature is
+// trusted. Some file systems keep whole seconds, and some kernels only
+// move file times on once a tick
+#define RACY_WINDOW_NS 1000000000LL
+
+// What a file looked like on disk when it was last hashed or restored
+struct file_cache {
+    off_t size;
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+    ino_t inode; // 0 if nothing is cached
 };
 
 struct tracked_file {
-    char *file_name;
+    struct path *path; // Shared with every other file of the same name
     int hash;
     char change;
+    uint64_t digest; // Content digest naming the file's blob, 0 if unknown
+    struct file_cache cache;
+    char lazy; // Set until a lazy checkout copies it into the workspace
+};
+
+// A file in a commit's tree of tracked files. Nodes are shared between
+// commits and never changed once the commit is made
+struct tree_node {
+    struct tree_node *left;
+    struct tree_node *right;
+    struct path *path;
+    uint64_t digest;
+    size_t size; // Number of files in this subtree
+    int hash;
+    uint32_t gen; // The edit that made this node
 };
 
 typedef struct resolution {
@@ -45,12 +256,27 @@ void *svc_init(void);
 
 void cleanup(void *helper);
 
+void *svc_open(char *path);
+
+int svc_close(void *helper);
+
+int svc_memory_stats(void *helper, struct svc_memory_stats *stats);
+
 int hash_file(void *helper, char *file_path);
 
+void svc_set_strong_hash(void *helper, int enabled);
+
+void svc_set_compression(void *helper, int level);
+
+void svc_set_threads(void *helper, int n_threads);
+
 char *svc_commit(void *helper, char *message);
 
 void *get_commit(void *helper, char *commit_id);
 
+struct commit **get_commits_by_id(void *helper, char *commit_id,
+                                                 int *n_found);
+
 char **get_prev_commits(void *helper, void *commit, int *n_prev);
 
 void print_commit(void *helper, char *commit_id);
@@ -61,15 +287,48 @@ int svc_checkout(void *helper, char *branch_name);
 
 char **list_branches(void *helper, int *n_branches);
 
+char **svc_branch_names(void *helper, int *n_branches);
+
+char **svc_branch_names_prefix(void *helper, char *prefix, int *n_branches);
+
 int svc_add(void *helper, char *file_name);
 
+int svc_add_many(void *helper, char **file_names, int n_files, int *results);
+
+int svc_add_dir(void *helper, char *dir_path);
+
+int svc_add_glob(void *helper, char *pattern);
+
 int svc_rm(void *helper, char *file_name);
 
+int svc_rm_many(void *helper, char **file_names, int n_files, int *results);
+
 int svc_reset(void *helper, char *commit_id);
 
 char *svc_merge(void *helper, char *branch_name, resolution *resolutions,
                                                        int n_resolutions);
 
+char *svc_merge_base(void *helper, char *commit_a, char *commit_b);
+
+int svc_is_ancestor(void *helper, char *ancestor, char *descendant);
+
+struct svc_log *svc_log_open(void *helper, char *commit_id, int flags,
+                                                            char *path);
+
+void *svc_log_next(struct svc_log *log);
+
+void svc_log_close(struct svc_log *log);
+
+int svc_gc(void *helper, size_t bytes_per_sec);
+
+int svc_set_sparse(void *helper, char **patterns, int n_patterns);
+
+void svc_set_lazy(void *helper, int lazy);
+
+int svc_hydrate(void *helper, char *path);
+
+int svc_gc_wait(void *helper);
+
 void set_commit_id(struct commit*);
 
 int compar(const void *a, const void *b);
@@ -80,7 +339,7 @@ char *str_concat(char ** arr, size_t n_strings);
 
 int check_changes(struct helper *helper);
 
-void set_to_commit(struct helper *helper, struct branch *branch,
-                                          struct commit *commit);
+int set_to_commit(struct helper *helper, struct branch *from,
+                  struct branch *branch, struct commit *commit);
 
 #endif